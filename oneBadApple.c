@@ -5,20 +5,44 @@
  *
  * Authors: Gerrit Mitchell + Shah Kamali
  *
- * Build:   gcc -Wall -Wextra -O2 -std=c11 oneBadApple.c -o oneBadApple (code I used to run in docker)
- * Run:     ./oneBadApple
+ * Build:   gcc -Wall -Wextra -O2 -std=c11 -pthread oneBadApple.c -o oneBadApple (code I used to run in docker)
+ * Run:     ./oneBadApple                      (interactive, prompts for k)
+ *          ./oneBadApple -k 8 -b msgs.tsv     (batch: one "dest<TAB>text" per line)
+ *          producer | ./oneBadApple -k 8 -b - (batch records from stdin)
+ *          ./oneBadApple -k 8 -t 4 -b msgs.tsv (4 apples in flight at once)
+ *          printf '*\thi all\n1,3-5\thi some\n' | ./oneBadApple -k 8 -b -
+ *                                             (broadcast and multicast, one lap each)
+ *          ./oneBadApple -k 8 -s 4 -b msgs.tsv (each apple carries up to 4 messages)
+ *          ./oneBadApple -k 8 -T shm          (neighbors share memory rings, not pipes)
+ *          ./oneBadApple -k 64 --threads -b msgs.tsv (nodes are threads of one process)
+ *          ./oneBadApple --bench 10000 -k 4,16,64 --size 16,1000 --format json
+ *                                             (throughput/latency sweep, one ring per row)
+ *          ./oneBadApple -k 8 -q --trace-buf 4096 --trace-dir /tmp/t -b msgs.tsv
+ *          ./oneBadApple --merge-traces /tmp/t  (all nodes' hop events in time order)
+ *          ./oneBadApple -k 16 --listen /tmp/oba.sock &   (ring stays up for clients)
+ *          ./oneBadApple --submit /tmp/oba.sock -b msgs.tsv
+ *          ./oneBadApple -T tcp --hosts ring.hosts --node-id 1   (on each host, one per node;
+ *          ./oneBadApple -T tcp --hosts ring.hosts -b msgs.tsv   node 0 takes the input)
+ *          ./oneBadApple --microbench 20000 --format json (per-hop primitives in isolation)
  *
  * Summary:
- *   k processes are arranged in a ring with unidirectional pipes.
- *   Each node only writes to its right neighbor and reads from its left neighbor.
- *   A single "apple" message circulates. When the header is empty, node 0
- *   asks the user for a destination and text and injects a message.
- *   When a node receives a message addressed to it, it prints/handles it
- *   and clears the header back to empty so the apple can return to node 0.
- *   Ctrl-C (SIGINT) or type q in the parent sends SIGUSR1 to all children for a graceful exit.
+ *   k nodes are arranged in a ring: forked processes, or threads with --threads,
+ *   or separate processes on any hosts with -T tcp. Edges are pipes by default,
+ *   shared-memory rings with -T shm, or TCP connections.
+ *   --topology bi adds the reverse edges and finger adds i -> i+2^j shortcuts;
+ *   each node sends a message the shorter way.
+ *   -t apples circulate at once, each with -s message slots. When an apple
+ *   reaches node 0, it fills the free slots from the prompt, -b input or
+ *   --listen clients; long messages are cut into chunks across apples.
+ *   A node delivers the slots addressed to it, frees them, and forwards what is
+ *   left, so the apple returns to node 0.
+ *   --watchdog reissues apples that don't come back and respawns dead nodes.
+ *   Ctrl-C (SIGINT), SIGTERM or q in the parent stops every node with one
+ *   SIGUSR1 to the ring's process group (threads via their control pipes).
+ *   The shm transport uses eventfd, so that mode is Linux-only.
  *
  *************************************************************/
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -26,69 +50,1083 @@
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-#define MAX_K 64
+#define MAX_K (1 << 16)   // sanity bound; RLIMIT_NOFILE/RLIMIT_NPROC are the real limits
 #define MAX_TEXT 1024
+#define MAX_LIST 16       // entries in a --bench sweep list
+#define MAX_TOKENS 64
+#define MAX_SLOTS 8       // message slots one apple can carry
+#define PIPE_CAPACITY 65536
+
+/* A slot carries one chunk of a message: messages longer than a slot's
+ * payload are cut into chunks that share (origin, seq) and travel in as many
+ * slots as it takes, so the ring pipelines them and only the destination
+ * ever holds the whole message. */
+#define CHUNK_MAX (MAX_TEXT - 1)
+
+/* Fan-out destinations. The slot stays aboard while every matching node
+ * takes a copy and is only cleared when the apple is back at its origin,
+ * so one lap reaches them all. */
+#define DEST_ALL   (-4)   // broadcast: every node but the origin
+#define DEST_GROUP (-5)   // multicast: the nodes listed in slot.group
+#define MAX_RANGES 32     // runs of consecutive ids one multicast list may hold
+typedef struct {
+    uint16_t n;                     // ranges in use
+    uint16_t lo[MAX_RANGES];        // inclusive, sorted, disjoint, non-adjacent
+    uint16_t hi[MAX_RANGES];
+} group_t;
 
-#define DEST_EMPTY (-1)   // "apple" with empty header (free to use)
 typedef struct {
-    int dest;             // -1 means empty; 0..k-1 otherwise
+    int dest;             // 0..k-1, DEST_ALL or DEST_GROUP
     int origin;           // node id that created the message
-    char text[MAX_TEXT];  // payload (NUL-terminated)
+    unsigned seq;         // per-origin message number
+    unsigned hops;        // edges crossed so far
+    uint64_t t_sent;      // CLOCK_MONOTONIC ns at injection
+    uint32_t len;         // bytes of text in this chunk (<= CHUNK_MAX)
+    uint32_t offset;      // where this chunk starts in the message
+    uint32_t total;       // message length; len == total for an unchunked message
+    int prio;             // PRIO_URGENT or PRIO_BULK
+    int lz;               // the message is lz_pack output, unpacked at the destination
+    char text[MAX_TEXT];  // chunk payload (NUL-terminated for printing)
+    group_t group;        // dest == DEST_GROUP: who gets a copy
+} slot_t;
+
+/* Priority classes: node 0 loads urgent messages ('!' before a record's
+ * destination) ahead of bulk ones, from one read-ahead queue per class */
+#define PRIO_URGENT 0
+#define PRIO_BULK   1
+#define NPRIO       2
+
+typedef struct {
+    int id;                    // token number assigned by node 0 when seeding
+    int used;                  // occupied slots, packed at slot[0..used); 0 = empty apple
+    int flags;                 // APPLE_* routing bits, set by node 0
+    slot_t slot[MAX_SLOTS];
 } apple_t;
 
+#define APPLE_CCW 0x1          // --topology bi: travelling i -> i-1
+
+/* Wire format: apple header, one slot header per occupied slot, then each
+ * slot's multicast ranges (ranges x uint16 lo,hi; none for other slots) and
+ * payload, back to back (no NUL). An empty apple is just the 8-byte header. */
+typedef struct {
+    uint32_t id;
+    uint16_t used;
+    uint16_t flags;
+} apple_hdr_t;
+
+typedef struct {
+    uint64_t t_sent;
+    int32_t  dest;
+    int32_t  origin;
+    uint32_t len;
+    uint32_t seq;
+    uint32_t hops;
+    uint32_t offset;
+    uint32_t total;
+    uint16_t ranges;      // DEST_GROUP member ranges ahead of the payload
+    uint16_t bits;        // class in the low byte, SLOT_LZ above
+} slot_hdr_t;
+#define SLOT_LZ 0x100
+
+#define RANGE_BYTES (2 * sizeof(uint16_t))
+#define MAX_FRAME (sizeof(apple_hdr_t) + \
+                   MAX_SLOTS * (sizeof(slot_hdr_t) + MAX_RANGES * RANGE_BYTES + MAX_TEXT))
+
+/* Single-producer/single-consumer byte ring for one edge, placed in a
+ * MAP_SHARED region before fork. head/tail only ever grow; the producer
+ * owns head, the consumer owns tail, each on its own cache line. */
+#define RING_BYTES PIPE_CAPACITY   // power of two
+typedef struct {
+    _Alignas(64) atomic_uint head;
+    atomic_int  reader_waiting;    // consumer is (about to be) asleep on data_efd
+    _Alignas(64) atomic_uint tail;
+    atomic_int  writer_waiting;    // producer is (about to be) asleep on space_efd
+    _Alignas(64) atomic_int closed;
+    char data[RING_BYTES];
+} spsc_ring_t;
+
+/* One end of an edge between neighbors */
+typedef enum { CHAN_PIPE, CHAN_SHM, CHAN_TCP } chan_kind_t;
+typedef struct {
+    chan_kind_t  kind;
+    int          fd;         // CHAN_PIPE: our end of the pipe; CHAN_TCP: the socket
+    spsc_ring_t *ring;       // CHAN_SHM: shared ring
+    int          data_efd;   // CHAN_SHM: producer -> consumer wakeup
+    int          space_efd;  // CHAN_SHM: consumer -> producer wakeup
+} chan_t;
+
+/* edge[i] carries apples from node i to node (i+1)%k; shm edges share the
+ * ring and wakeup eventfds between both ends, pipe edges are one fd each */
+typedef struct {
+    chan_t rd;
+    chan_t wr;
+} edge_t;
+
 /* Globals used by parent (node 0) for cleanup */
-static pid_t child_pids[MAX_K];
-static int   num_children = 0;
+static pid_t *child_pids = NULL;   // sized to k by run_ring
+static int    num_children = 0;
+static pid_t  g_ring_pgid = 0;     // process group of all the children, signalled as one
+static volatile sig_atomic_t g_interrupted = 0;   // SIGINT/SIGTERM seen; a second one forces
 static int   g_k = 0;
 static int   g_parent = 1;
 
-/* Per-process globals (each process keeps only the fds it needs) */
-static int read_fd = -1;
-static int write_fd = -1;
-static int my_id = -1;
+/* Batch mode: node 0 pulls "dest<TAB>text" records from here instead of prompting */
+static FILE *g_batch = NULL;
 
-/* Children set this flag when asked to stop via SIGUSR1 */
-static volatile sig_atomic_t stop_requested = 0;
+/* Apples node 0 seeded and has not yet retired (batch input ran dry) */
+static int g_tokens = 1;
+static int g_tokens_live = 0;
 
-/* Utility: safe write of exactly n bytes */
-static int write_full(int fd, const void *buf, size_t n) {
-    const char *p = (const char *)buf;
-    size_t left = n;
-    while (left > 0) {
-        ssize_t w = write(fd, p, left);
-        if (w < 0) {
-            if (errno == EINTR) continue;
+/* --inflight B: payload bytes node 0 may have out on apples that haven't
+ * come back yet (0 = no limit). Every returning apple hands its bytes back
+ * as credit, so queues on every edge stay bounded however fast input is. */
+static uint64_t g_inflight_max = 0;
+static uint64_t g_inflight = 0;
+static uint32_t g_lap_bytes[MAX_TOKENS];   // loaded onto token i this lap
+
+/* --compress N: node 0 LZ-compresses messages of at least N bytes before
+ * they go out and only the destination unpacks them, so transit nodes move
+ * fewer bytes (0 = off). Counted over the messages it was tried on. */
+static uint32_t g_lz_min = 0;
+static uint64_t g_lz_raw = 0, g_lz_wire = 0;
+
+/* --watchdog MS: node 0 reissues any token that hasn't come home within MS
+ * and respawns children that die (forked pipe rings). A reissued token keeps
+ * its index but gets a new apple id, id % MAX_TOKENS, so the old apple is
+ * recognised and dropped if it ever turns up again. */
+static uint64_t g_watchdog_ns = 0;
+static uint32_t g_token_id[MAX_TOKENS];     // apple id token i currently travels as
+static uint64_t g_token_sent[MAX_TOKENS];   // when it last left node 0, 0 = retired
+static uint64_t g_fault_ns = 0;             // first sign of the fault being recovered from
+static int     *g_plumb = NULL;             // node 0's end of each child's fd-passing socket
+static struct {
+    unsigned faults, respawns, reissued, stale, recovered;
+    uint64_t recover_ns_sum, recover_ns_max, respawn_ns_max;
+} g_wd;
+
+/* Slots node 0 may fill per apple (1 = the assignment's one message per lap) */
+static int g_slots = 1;
+
+static chan_kind_t g_transport = CHAN_PIPE;
+
+/* -T tcp: one process per node, each started by hand (on any host) with
+ * --hosts FILE --node-id I; FILE gives every node id's host:port */
+#define TCP_CONNECT_MS 30000   // how long a node waits for its neighbours to come up
+typedef struct {
+    char host[256];
+    char port[16];
+} host_t;
+static host_t *g_hosts = NULL;   // indexed by node id, g_k entries
+static int     g_node_id = 0;    // the node this process is
+
+/* --threads: nodes 1..k-1 are pthreads of this process instead of children */
+static int g_threads = 0;
+
+/* --spin N: checks of the idle shm inbound rings before sleeping in poll() */
+static unsigned g_spin = 0;
+
+/* --splice: transit nodes move payloads pipe-to-pipe without reading them */
+static int g_splice = 0;
+
+/* --worker: each node hands finished messages to its own handler thread
+ * and goes straight back to forwarding. --handler-us N makes the handler
+ * sleep N us per message, like one waiting on disk or a network call. */
+static int      g_worker = 0;
+static uint64_t g_handler_ns = 0;
+
+/* --cpus LIST: node i runs on g_cpus[i % g_ncpus], and each shm ring's pages
+ * are preferred on the NUMA node of the CPU that reads it */
+static int *g_cpus = NULL;
+static int  g_ncpus = 0;
+
+/* --topology: which edges the ring has (see topo_build) */
+#define TOPO_UNI 0   // the assignment's ring: i -> i+1
+#define TOPO_BI  1   // plus i -> i-1, routed the shorter way round
+#define TOPO_FINGER 2   // plus i -> i+2, i+4, i+8, ... (Chord-style skip links)
+static int g_topology = TOPO_UNI;
+
+/* Benchmark mode: node 0 generates g_bench_n synthetic messages and every
+ * recipient stamps its delivery into a table shared across the fork. */
+#define BENCH_SIZE_MAX (1 << 24)   // bench payloads over CHUNK_MAX go out in chunks
+#define DEST_RR     (-1)   // 1, 2, ..., k-1, 0, 1, ...
+#define DEST_RANDOM (-2)
+#define DEST_FAR    (-3)   // k-1: the longest unidirectional trip
+typedef struct {
+    atomic_ullong lat_ns;  // injection -> handler done
+    atomic_uint   hops;    // 0 = never delivered
+    uint32_t      prio;    // class node 0 sent it in
+} bench_rec_t;
+static int          g_bench_n = 0;
+static int          g_bench_size = 0;
+static int          g_bench_dest = DEST_RR;
+static int          g_bench_sent = 0;
+static bench_rec_t *g_bench_recs = NULL;
+static int          g_urgent_pct = 0;   // --urgent: share of bench messages sent urgent
+/* Ring-wide I/O totals, summed by every node as it leaves its loop */
+typedef struct {
+    atomic_ullong rd_calls, rd_frames;
+    atomic_ullong wr_calls, wr_frames;
+    atomic_ullong blocked_ns_max;   // worst node's time with a write stuck
+} bench_io_t;
+static bench_io_t  *g_bench_io = NULL;
+static uint64_t     g_run_start_ns = 0;
+static uint64_t     g_run_end_ns = 0;
+static uint64_t     g_setup_ns = 0;     // run_ring entry until every node exists
+static uint64_t     g_teardown_ns = 0;  // node 0's loop ending until every node is reaped
+/* Each bench ring first sends its tokens round empty for about this many
+ * hops in all, so the cost of a bare "your turn" lap is measured apart from
+ * loaded traffic; the timed run starts when they are done */
+#define BENCH_EMPTY_HOPS 20000
+static int          g_empty_left = 0;
+static int          g_empty_laps = 0;
+static uint64_t     g_empty_ns = 0;
+
+/* Log levels: silent prints nothing on the forwarding path, deliver prints
+ * deliveries and ring lifecycle, trace (the default) narrates every hop. */
+#define LOG_SILENT  0
+#define LOG_DELIVER 1
+#define LOG_TRACE   2
+static int g_log = -1;   // -1 until main picks the mode's default
+#define log_deliver(...) do { if (g_log >= LOG_DELIVER) printf(__VA_ARGS__); } while (0)
+#define log_trace(...)   do { if (g_log >= LOG_TRACE) printf(__VA_ARGS__); } while (0)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Per-node hop trace: a fixed power-of-two ring of events that only this
+ * node writes, so recording is a few stores with no locks and no stdio.
+ * The oldest events are overwritten; the file says how many were dropped. */
+typedef enum { EV_RECV, EV_FORWARD, EV_DELIVER, EV_INJECT, EV_RETIRE } ev_type_t;
+static const char *const ev_names[] = {"recv", "forward", "deliver", "inject", "retire"};
+typedef struct {
+    uint64_t ts_ns;
+    uint32_t apple_id;
+    uint32_t seq;       // slot seq for deliver/inject, else 0
+    int32_t  dest;      // slot dest (first slot for apple events), -1 if none
+    int32_t  origin;
+    uint16_t used;      // occupied slots after the event
+    uint8_t  type;
+} trace_ev_t;
+
+static unsigned    g_trace_cap = 0;         // from --trace-buf, rounded up to 2^n
+static const char *g_trace_dir = ".";
+
+/* Live counters, one page-ish block per node in a MAP_SHARED table mapped
+ * before fork. A node (and its worker) only adds to its own block; node 0
+ * reads them all for a SIGUSR2 or --stats report while the ring runs.
+ * Latencies go in an HDR-style histogram: exact below 8 ns, then 8
+ * sub-buckets per power of two (12.5% resolution). */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+typedef struct {
+    atomic_ullong forwarded;      // apples sent on
+    atomic_ullong empty;          // ...of which were empty
+    atomic_ullong delivered;      // whole messages handled here
+    atomic_ullong bytes_in;
+    atomic_ullong bytes_out;
+    atomic_ullong blocked_ns;     // outbound bytes stuck behind a full channel
+    atomic_ullong idle_ns;        // asleep in poll() with nothing to do
+    atomic_uint   lat_hist[HIST_BUCKETS];   // injection -> handler done
+    atomic_uint   lat_hist_urgent[HIST_BUCKETS];   // ...of urgent messages only
+} node_stats_t;
+static node_stats_t *g_stats = NULL;   // indexed by node id, sized to k by run_ring
+static int           g_stats_at_exit = 0;
+
+static void stat_add(atomic_ullong *c, uint64_t n) {
+    atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+
+static int hist_bucket(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS)) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           (int)((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+/* Smallest value that lands in bucket b */
+static uint64_t hist_low(int b) {
+    if (b < (1 << HIST_SUB_BITS)) return (uint64_t)b;
+    int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t top = (1u << HIST_SUB_BITS) + (uint64_t)(b & ((1 << HIST_SUB_BITS) - 1));
+    return top << (e - HIST_SUB_BITS);
+}
+
+/* A node's side of one edge plus the bytes buffered on it */
+#define RX_BYTES (64 * 1024)
+typedef struct {
+    chan_t ch;
+    char  *buf;         // rx: received but not yet parsed; tx: encoded but not yet written
+    size_t len;
+    size_t cap;
+    size_t off;         // tx: bytes of buf already written
+    size_t splice_left; // rx, --splice: payload bytes still to move to out[splice_to]
+    int    splice_to;
+    int    splice_out;  // rx, --splice: that move is waiting for the outbound pipe
+    uint64_t calls;     // reads/writes (or shm ring ops) that moved bytes
+    uint64_t frames;    // apples carried by them
+    uint64_t blocked_since;   // tx: when the channel last refused bytes, 0 = flowing
+    uint64_t blocked_ns;      // tx: total time spent with bytes stuck behind a full channel
+    node_stats_t *stats;      // the owning node's live counters
+} link_t;
+
+/* A message on its way out in chunks; text is borrowed from the input
+ * source and stays valid until the next message is requested */
+typedef struct {
+    const char *text;
+    uint32_t    len;
+    uint32_t    off;        // bytes already loaded into slots
+    int         dest;
+    const group_t *group;   // dest == DEST_GROUP: members, borrowed like text
+    unsigned    seq;
+    int         prio;
+    int         lz;         // text is lz_pack output
+    uint64_t    t_sent;     // when node 0 took it from its input
+} outmsg_t;
+
+/* A chunked message being reassembled at its destination */
+typedef struct {
+    int      origin;
+    unsigned seq;
+    uint32_t total;
+    uint32_t got;
+    uint8_t *have;          // a bit per chunk already copied in, after the text
+    unsigned hops;          // of the last chunk to arrive
+    uint64_t t_sent;
+    uint64_t t_last;        // --watchdog: when the last chunk arrived
+    char    *buf;
+} inmsg_t;
+
+/* A whole message handed to the node's handler */
+typedef struct {
+    int      apple_id;
+    int      origin;
+    unsigned seq;
+    unsigned hops;
+    uint32_t total;
+    int      prio;
+    uint64_t t_sent;
+    char    *text;          // NUL-terminated; owned by the worker queue when queued
+} delivery_t;
+
+/* What a node does with a message addressed to it. Runs on the node's own
+ * thread, or on its worker thread under --worker, so it must not touch
+ * the node's links. */
+typedef void (*msg_handler_t)(int node_id, const delivery_t *d);
+
+/* Everything one ring node owns. A node only ever touches its own node_t;
+ * it waits in poll() on its inbound links, any outbound link with queued
+ * bytes, and a control self-pipe, so stop/dump requests can't be missed
+ * between a flag check and a blocking read. */
+#define MAX_LINKS 17     // inbound or outbound edges per node (finger tables: log2(MAX_K) + 1)
+typedef struct {
+    int         id;
+    int         nin, nout;
+    link_t     *in;               // sized by node_add_in/out while the ring is built
+    link_t     *out;
+    int         ctl_rd, ctl_wr;   // control self-pipe: 's' = stop, 'd' = dump trace,
+                                  // 'c' = a child exited
+    int         stop;
+    int         wd_fd;            // --watchdog: node 0's lap timer, a child's socket from node 0
+    int         reap;             // node 0: a child exited, respawn it after this pass
+    int         empty_route;      // out[] an empty apple leaves by, fixed per node
+    node_stats_t *stats;          // &g_stats[id]
+    unsigned    next_seq;         // seq given to this node's next message
+    trace_ev_t *trace;
+    uint64_t    trace_head;
+    outmsg_t    tx_msg[NPRIO];    // per class: message being cut into chunks, if .text
+    inmsg_t    *rx_msgs;          // chunked messages to us still being reassembled
+    int         nrx_msgs;
+    int         rx_msgs_cap;
+
+    /* --worker: deliveries waiting for the handler thread, a growable ring */
+    int             has_worker;
+    pthread_t       worker;
+    pthread_mutex_t q_mu;
+    pthread_cond_t  q_cv;
+    delivery_t     *q;
+    int             q_head, q_len, q_cap;
+    int             q_peak;           // most deliveries ever waiting
+    int             q_stop;           // set by node_loop once it is done
+} node_t;
+
+/* The node this process runs; the signal handlers poke its control pipe */
+static node_t *g_self = NULL;
+
+/* Thread mode: node 0 reaches the other nodes through their control pipes */
+static node_t *g_peers = NULL;    // indexed by node id, [0] unused
+static int     g_npeers = 0;      // peers initialised so far (ids 1..g_npeers)
+
+static void trace_event(node_t *self, ev_type_t type, int apple_id, int dest, int origin,
+                        unsigned seq, int used) {
+    if (!self->trace) return;
+    trace_ev_t *ev = &self->trace[self->trace_head++ & (g_trace_cap - 1)];
+    ev->ts_ns    = now_ns();
+    ev->apple_id = (uint32_t)apple_id;
+    ev->seq      = seq;
+    ev->dest     = dest;
+    ev->origin   = origin;
+    ev->used     = (uint16_t)used;
+    ev->type     = (uint8_t)type;
+}
+
+/* Write this node's events, oldest first, to <trace-dir>/node-<id>.trace */
+static void trace_dump(node_t *self) {
+    if (!self->trace) return;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/node-%d.trace", g_trace_dir, self->id);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "[Node %d] trace dump: %s: %s\n", self->id, path, strerror(errno));
+        return;
+    }
+    uint64_t n = self->trace_head < g_trace_cap ? self->trace_head : g_trace_cap;
+    fprintf(f, "# node %d pid %d events %llu dropped %llu\n", self->id, getpid(),
+            (unsigned long long)n, (unsigned long long)(self->trace_head - n));
+    for (uint64_t i = self->trace_head - n; i < self->trace_head; ++i) {
+        const trace_ev_t *ev = &self->trace[i & (g_trace_cap - 1)];
+        fprintf(f, "%llu %d %s %u %d %d %u %u\n", (unsigned long long)ev->ts_ns, self->id,
+                ev_names[ev->type], ev->apple_id, ev->dest, ev->origin, ev->seq, ev->used);
+    }
+    fclose(f);
+}
+
+/* Quantile q of a merged latency histogram, as its bucket's lower bound */
+static uint64_t hist_quantile(const uint64_t *hist, uint64_t n, double q) {
+    uint64_t want = (uint64_t)(q * (double)(n - 1)) + 1, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+        seen += hist[b];
+        if (seen >= want) return hist_low(b);
+    }
+    return 0;
+}
+
+/* Node 0: print every node's counters and the ring-wide latency spread.
+ * Reads the live table, so it is a snapshot, not a consistent cut. Under
+ * -T tcp the table is this process's alone, so each node reports itself. */
+static void stats_dump(void) {
+    uint64_t hist[HIST_BUCKETS] = {0}, urgent[HIST_BUCKETS] = {0}, tot[7] = {0}, n = 0, nu = 0;
+    int rows = g_k <= 64;
+    fprintf(stderr, "[Node %d] Stats for k=%d%s\n", g_node_id, g_k, rows ? ":" : " (totals only):");
+    if (rows) {
+        fprintf(stderr, "  node   forwarded      empty  delivered    bytes_in   bytes_out"
+                        "  blocked_ms    idle_ms\n");
+    }
+    for (int i = 0; i < g_k; ++i) {
+        if (g_transport == CHAN_TCP && i != g_node_id) continue;
+        node_stats_t *st = &g_stats[i];
+        uint64_t v[7] = {atomic_load_explicit(&st->forwarded, memory_order_relaxed),
+                         atomic_load_explicit(&st->empty, memory_order_relaxed),
+                         atomic_load_explicit(&st->delivered, memory_order_relaxed),
+                         atomic_load_explicit(&st->bytes_in, memory_order_relaxed),
+                         atomic_load_explicit(&st->bytes_out, memory_order_relaxed),
+                         atomic_load_explicit(&st->blocked_ns, memory_order_relaxed),
+                         atomic_load_explicit(&st->idle_ns, memory_order_relaxed)};
+        for (int j = 0; j < 7; ++j) tot[j] += v[j];
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            uint64_t c = atomic_load_explicit(&st->lat_hist[b], memory_order_relaxed);
+            hist[b] += c;
+            n += c;
+            c = atomic_load_explicit(&st->lat_hist_urgent[b], memory_order_relaxed);
+            urgent[b] += c;
+            nu += c;
+        }
+        if (rows) {
+            fprintf(stderr, "  %4d %11llu %10llu %10llu %11llu %11llu %11.3f %10.3f\n", i,
+                    (unsigned long long)v[0], (unsigned long long)v[1], (unsigned long long)v[2],
+                    (unsigned long long)v[3], (unsigned long long)v[4],
+                    (double)v[5] / 1e6, (double)v[6] / 1e6);
+        }
+    }
+    fprintf(stderr, "   all %11llu %10llu %10llu %11llu %11llu %11.3f %10.3f\n",
+            (unsigned long long)tot[0], (unsigned long long)tot[1], (unsigned long long)tot[2],
+            (unsigned long long)tot[3], (unsigned long long)tot[4],
+            (double)tot[5] / 1e6, (double)tot[6] / 1e6);
+    if (n) {
+        fprintf(stderr, "  latency ns (bucket floors, within 12.5%%): p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+                (unsigned long long)hist_quantile(hist, n, 0.50),
+                (unsigned long long)hist_quantile(hist, n, 0.90),
+                (unsigned long long)hist_quantile(hist, n, 0.99),
+                (unsigned long long)hist_quantile(hist, n, 0.999),
+                (unsigned long long)hist_quantile(hist, n, 1.0));
+    }
+    if (g_lz_raw) {
+        fprintf(stderr, "  compression: %llu bytes of messages went out as %llu (%.2fx)\n",
+                (unsigned long long)g_lz_raw, (unsigned long long)g_lz_wire,
+                (double)g_lz_raw / (double)g_lz_wire);
+    }
+    if (nu) {
+        /* The bulk class is whatever isn't urgent */
+        for (int b = 0; b < HIST_BUCKETS; ++b) hist[b] -= urgent[b];
+        fprintf(stderr, "  by class: urgent %llu msgs, p50 %llu  p99 %llu;  bulk %llu msgs, "
+                "p50 %llu  p99 %llu\n", (unsigned long long)nu,
+                (unsigned long long)hist_quantile(urgent, nu, 0.50),
+                (unsigned long long)hist_quantile(urgent, nu, 0.99), (unsigned long long)(n - nu),
+                n > nu ? (unsigned long long)hist_quantile(hist, n - nu, 0.50) : 0ull,
+                n > nu ? (unsigned long long)hist_quantile(hist, n - nu, 0.99) : 0ull);
+    }
+}
+
+/* Act on whatever the signal handlers (or a peer thread) wrote to our control pipe */
+static void node_control(node_t *self) {
+    char cmds[64];
+    ssize_t n;
+    while ((n = read(self->ctl_rd, cmds, sizeof(cmds))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) {
+            if (cmds[i] == 's') self->stop = 1;
+            else if (cmds[i] == 'c') self->reap = 1;
+            else if (cmds[i] == 'd') {
+                trace_dump(self);
+                if (self->id == 0) stats_dump();
+            }
+        }
+    }
+}
+
+static void efd_signal(int efd) {
+    uint64_t one = 1;
+    ssize_t w = write(efd, &one, sizeof(one));
+    (void)w;   // only fails if the counter would overflow, which still wakes the peer
+}
+
+/* Reset a wakeup eventfd after poll reported it */
+static void efd_drain(int efd) {
+    uint64_t v;
+    ssize_t r = read(efd, &v, sizeof(v));
+    (void)r;   // EAGAIN just means someone else's wakeup was already consumed
+}
+
+/* Producer side: copy what fits into the ring. When it is full, raise
+ * writer_waiting and re-check before reporting EAGAIN; the waiting flags are
+ * seq_cst so a wakeup can't slip between that check and the caller's poll. */
+static ssize_t ring_send(chan_t *c, const void *buf, size_t n) {
+    spsc_ring_t *r = c->ring;
+    if (atomic_load(&r->closed)) {
+        errno = EPIPE;
+        return -1;
+    }
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned room = RING_BYTES - (head - atomic_load_explicit(&r->tail, memory_order_acquire));
+    if (room == 0) {
+        atomic_store(&r->writer_waiting, 1);
+        room = RING_BYTES - (head - atomic_load(&r->tail));
+        if (room == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    size_t chunk = n < room ? n : room;
+    size_t off   = head & (RING_BYTES - 1);
+    size_t first = chunk < RING_BYTES - off ? chunk : RING_BYTES - off;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, (const char *)buf + first, chunk - first);
+    atomic_store(&r->head, head + (unsigned)chunk);
+    if (atomic_exchange(&r->reader_waiting, 0)) efd_signal(c->data_efd);
+    return (ssize_t)chunk;
+}
+
+/* Consumer side: copy out what is there; 0 once the peer closed and it's drained */
+static ssize_t ring_recv(chan_t *c, void *buf, size_t n) {
+    spsc_ring_t *r = c->ring;
+    unsigned tail  = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned avail = atomic_load_explicit(&r->head, memory_order_acquire) - tail;
+    if (avail == 0) {
+        atomic_store(&r->reader_waiting, 1);
+        avail = atomic_load(&r->head) - tail;
+        if (avail == 0) {
+            if (atomic_load(&r->closed)) return 0;   /* peer gone: like pipe EOF */
+            errno = EAGAIN;
             return -1;
         }
-        left -= (size_t)w;
-        p += w;
     }
+    size_t chunk = n < avail ? n : avail;
+    size_t off   = tail & (RING_BYTES - 1);
+    size_t first = chunk < RING_BYTES - off ? chunk : RING_BYTES - off;
+    memcpy(buf, r->data + off, first);
+    memcpy((char *)buf + first, r->data, chunk - first);
+    atomic_store(&r->tail, tail + (unsigned)chunk);
+    if (atomic_exchange(&r->writer_waiting, 0)) efd_signal(c->space_efd);
+    return (ssize_t)chunk;
+}
+
+/* Non-blocking transfer: bytes moved, 0 = peer closed (recv), -1 with errno
+ * (EAGAIN = poll the fd from chan_poll_rx/chan_poll_tx and retry) */
+static ssize_t chan_send(chan_t *c, const void *buf, size_t n) {
+    if (c->kind == CHAN_SHM) return ring_send(c, buf, n);
+    ssize_t w;
+    do { w = write(c->fd, buf, n); } while (w < 0 && errno == EINTR);
+    return w;
+}
+
+static ssize_t chan_recv(chan_t *c, void *buf, size_t n) {
+    if (c->kind == CHAN_SHM) return ring_recv(c, buf, n);
+    ssize_t r;
+    do { r = read(c->fd, buf, n); } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+static void chan_poll_rx(const chan_t *c, struct pollfd *p) {
+    p->fd = c->kind == CHAN_SHM ? c->data_efd : c->fd;
+    p->events = POLLIN;
+}
+
+static void chan_poll_tx(const chan_t *c, struct pollfd *p) {
+    p->fd = c->kind == CHAN_SHM ? c->space_efd : c->fd;
+    p->events = c->kind == CHAN_SHM ? POLLIN : POLLOUT;
+}
+
+/* Release our end; for shm also tell the peer, since there is no kernel EOF */
+static void chan_close(chan_t *c) {
+    if (c->kind == CHAN_SHM && c->ring) {
+        atomic_store(&c->ring->closed, 1);
+        efd_signal(c->data_efd);
+        efd_signal(c->space_efd);
+        c->ring = NULL;
+    }
+    if (c->fd        >= 0) close(c->fd);
+    if (c->data_efd  >= 0) close(c->data_efd);
+    if (c->space_efd >= 0) close(c->space_efd);
+    c->fd = c->data_efd = c->space_efd = -1;
+}
+
+/* Create edge e; both ends are non-blocking since nodes multiplex with poll.
+ * Each end gets its own descriptors, so either can be handed to another
+ * process (or thread) and dropped here independently. */
+static int edge_open(edge_t *e, spsc_ring_t *ring) {
+    memset(e, 0, sizeof(*e));
+    e->rd.kind = e->wr.kind = g_transport;
+    e->rd.fd = e->wr.fd = e->rd.data_efd = e->wr.data_efd = -1;
+    e->rd.space_efd = e->wr.space_efd = -1;
+    if (g_transport == CHAN_PIPE) {
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK) < 0) return -1;
+        e->rd.fd = fds[0];
+        e->wr.fd = fds[1];
+        return 0;
+    }
+    int data_efd  = eventfd(0, EFD_NONBLOCK);
+    int space_efd = eventfd(0, EFD_NONBLOCK);
+    if (data_efd < 0 || space_efd < 0) return -1;
+    e->rd.ring = e->wr.ring = ring;
+    atomic_store(&ring->reader_waiting, 1);   /* reader starts out asleep in poll */
+    e->wr.data_efd  = data_efd;
+    e->wr.space_efd = space_efd;
+    e->rd.data_efd  = dup(data_efd);
+    e->rd.space_efd = dup(space_efd);
+    if (e->rd.data_efd < 0 || e->rd.space_efd < 0) return -1;
     return 0;
 }
 
-/* Utility: safe read of exactly n bytes (blocking) */
-static int read_full(int fd, void *buf, size_t n) {
-    char *p = (char *)buf;
-    size_t left = n;
-    while (left > 0) {
-        ssize_t r = read(fd, p, left);
-        if (r < 0) {
-            if (errno == EINTR) {
-                if (stop_requested) return -1; /* allow graceful exit */
-                continue;
+/* Drop this process's copy of an end that lives on elsewhere (no EOF/closed) */
+static void chan_forget(chan_t *c) {
+    if (c->fd        >= 0) close(c->fd);
+    if (c->data_efd  >= 0) close(c->data_efd);
+    if (c->space_efd >= 0) close(c->space_efd);
+    c->fd = c->data_efd = c->space_efd = -1;
+}
+
+/* Encode an apple as one frame; returns its length (at most MAX_FRAME) */
+static size_t apple_encode(const apple_t *a, char *frame) {
+    apple_hdr_t hdr = {.id = (uint32_t)a->id, .used = (uint16_t)a->used,
+                       .flags = (uint16_t)a->flags};
+    size_t off = sizeof(hdr);
+
+    memcpy(frame, &hdr, sizeof(hdr));
+    for (int i = 0; i < a->used; ++i) {
+        slot_hdr_t sh;
+        memset(&sh, 0, sizeof(sh));
+        sh.t_sent = a->slot[i].t_sent;
+        sh.dest   = a->slot[i].dest;
+        sh.origin = a->slot[i].origin;
+        sh.len    = a->slot[i].len;
+        sh.seq    = a->slot[i].seq;
+        sh.hops   = a->slot[i].hops;
+        sh.offset = a->slot[i].offset;
+        sh.total  = a->slot[i].total;
+        sh.ranges = a->slot[i].dest == DEST_GROUP ? a->slot[i].group.n : 0;
+        sh.bits   = (uint16_t)(a->slot[i].prio | (a->slot[i].lz ? SLOT_LZ : 0));
+        memcpy(frame + off, &sh, sizeof(sh));
+        off += sizeof(sh);
+    }
+    for (int i = 0; i < a->used; ++i) {
+        if (a->slot[i].dest == DEST_GROUP) {
+            const group_t *g = &a->slot[i].group;
+            for (int r = 0; r < g->n; ++r) {
+                memcpy(frame + off, &g->lo[r], sizeof(g->lo[r]));
+                memcpy(frame + off + sizeof(g->lo[r]), &g->hi[r], sizeof(g->hi[r]));
+                off += RANGE_BYTES;
             }
+        }
+        memcpy(frame + off, a->slot[i].text, a->slot[i].len);
+        off += a->slot[i].len;
+    }
+    return off;
+}
+
+/* Decode the frame at the front of buf: bytes consumed, 0 if it hasn't fully
+ * arrived yet, -1 if it can't be an apple_t */
+static ssize_t apple_decode(const char *buf, size_t len, apple_t *a) {
+    apple_hdr_t hdr;
+    slot_hdr_t  sh[MAX_SLOTS];
+
+    if (len < sizeof(hdr)) return 0;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.used > MAX_SLOTS) return -1;
+    size_t off = sizeof(hdr) + hdr.used * sizeof(sh[0]);
+    if (len < off) return 0;
+    memcpy(sh, buf + sizeof(hdr), hdr.used * sizeof(sh[0]));
+    size_t total = off;
+    for (uint32_t i = 0; i < hdr.used; ++i) {
+        if (sh[i].len > CHUNK_MAX || sh[i].offset > sh[i].total ||
+            sh[i].len > sh[i].total - sh[i].offset) return -1;
+        if (sh[i].ranges > MAX_RANGES || (sh[i].ranges > 0) != (sh[i].dest == DEST_GROUP))
             return -1;
-        } else if (r == 0) {
-            /* pipe closed */
-            return -1;
+        if ((sh[i].bits & 0xff) >= NPRIO || (sh[i].bits & ~(0xff | SLOT_LZ))) return -1;
+        total += sh[i].ranges * RANGE_BYTES + sh[i].len;
+    }
+    if (len < total) return 0;
+
+    a->id   = (int)hdr.id;
+    a->used = (int)hdr.used;
+    a->flags = (int)hdr.flags;
+    for (int i = 0; i < a->used; ++i) {
+        group_t *g = &a->slot[i].group;
+        g->n = (uint16_t)sh[i].ranges;
+        for (int r = 0; r < g->n; ++r) {
+            memcpy(&g->lo[r], buf + off, sizeof(g->lo[r]));
+            memcpy(&g->hi[r], buf + off + sizeof(g->lo[r]), sizeof(g->hi[r]));
+            if (g->lo[r] > g->hi[r]) return -1;
+            off += RANGE_BYTES;
+        }
+        memcpy(a->slot[i].text, buf + off, sh[i].len);
+        off += sh[i].len;
+        a->slot[i].text[sh[i].len] = '\0';
+        a->slot[i].dest   = sh[i].dest;
+        a->slot[i].origin = sh[i].origin;
+        a->slot[i].seq    = sh[i].seq;
+        a->slot[i].hops   = sh[i].hops + 1;   /* we just crossed one more edge */
+        a->slot[i].t_sent = sh[i].t_sent;
+        a->slot[i].len    = sh[i].len;
+        a->slot[i].offset = sh[i].offset;
+        a->slot[i].total  = sh[i].total;
+        a->slot[i].prio   = sh[i].bits & 0xff;
+        a->slot[i].lz     = (sh[i].bits & SLOT_LZ) != 0;
+    }
+    return (ssize_t)total;
+}
+
+/* Write as much queued tx as the channel takes; -1 only on a real error.
+ * The time between the first refusal and the buffer emptying counts as
+ * blocked. */
+static int link_flush(link_t *l) {
+    while (l->off < l->len) {
+        ssize_t w = chan_send(&l->ch, l->buf + l->off, l->len - l->off);
+        if (w < 0) {
+            if (errno != EAGAIN) return -1;
+            if (!l->blocked_since) l->blocked_since = now_ns();
+            return 0;
+        }
+        ++l->calls;
+        l->off += (size_t)w;
+        stat_add(&l->stats->bytes_out, (uint64_t)w);
+    }
+    if (l->blocked_since) {
+        uint64_t ns = now_ns() - l->blocked_since;
+        l->blocked_ns += ns;
+        stat_add(&l->stats->blocked_ns, ns);
+        l->blocked_since = 0;
+    }
+    l->off = l->len = 0;
+    return 0;
+}
+
+/* Make room for n more tx bytes on an outbound link */
+static int link_reserve(link_t *l, size_t n) {
+    if (l->cap - l->len >= n) return 0;
+    size_t cap = l->cap ? l->cap * 2 : 4 * MAX_FRAME;
+    while (cap - l->len < n) cap *= 2;
+    char *grown = realloc(l->buf, cap);
+    if (!grown) return -1;
+    l->buf = grown;
+    l->cap = cap;
+    return 0;
+}
+
+/* Queue a frame on an outbound link. Nothing is written yet: node_loop
+ * flushes every link once per wakeup, so all the apples handled in one pass
+ * leave in a single write. */
+static int link_send(link_t *l, const apple_t *a) {
+    if (link_reserve(l, MAX_FRAME) < 0) return -1;
+    l->len += apple_encode(a, l->buf + l->len);
+    ++l->frames;
+    return 0;
+}
+
+/* Same for bytes that are already wire format; these go out at once, since
+ * the splice path moves the payload behind them straight into the pipe */
+static int link_send_raw(link_t *l, const void *bytes, size_t n) {
+    if (link_reserve(l, n) < 0) return -1;
+    memcpy(l->buf + l->len, bytes, n);
+    l->len += n;
+    ++l->frames;
+    return link_flush(l);
+}
+
+/* Fill an inbound link's buffer: 1 = got bytes, 0 = nothing right now, -1 = EOF/error */
+static int link_fill(link_t *l) {
+    if (!l->buf) {
+        l->buf = malloc(RX_BYTES);
+        if (!l->buf) return -1;
+        l->cap = RX_BYTES;
+    }
+    ssize_t r = chan_recv(&l->ch, l->buf + l->len, l->cap - l->len);
+    if (r > 0) {
+        ++l->calls;
+        l->len += (size_t)r;
+        stat_add(&l->stats->bytes_in, (uint64_t)r);
+        return 1;
+    }
+    if (r < 0 && errno == EAGAIN) return 0;
+    return -1;   /* pipe closed */
+}
+
+/* --watchdog: the node on the far side of l is gone. Close our end and drop
+ * whatever was half-read or queued for it; node 0 respawns the neighbour and
+ * plumbs in a fresh pipe, and the tokens caught here are reissued. */
+static void link_down(link_t *l) {
+    if (l->ch.fd >= 0) close(l->ch.fd);
+    l->ch.fd = -1;
+    l->len = l->off = 0;
+    l->splice_left = 0;
+    l->splice_out = 0;
+    l->blocked_since = 0;
+}
+
+/* Put a new pipe end under l, starting on a frame boundary */
+static void link_replace(link_t *l, int fd) {
+    link_down(l);
+    l->ch.fd = fd;
+}
+
+/* Message compression in the LZ4 block format: sequences of a token byte
+ * (literal count << 4 | match length - 4, 15 = more length bytes follow),
+ * the literals, then a 16-bit little-endian match offset. The last
+ * sequence is literals only and the last 5 bytes are always literals.
+ * Greedy, one 4 KB-entry hash table; packed messages carry their raw
+ * length up front: [u32 raw][block]. */
+#define LZ_HASH_BITS 12
+#define LZ_MAX (1u << 30)   // longest message worth packing
+#define LZ_BOUND(n) (sizeof(uint32_t) + (n) + (n) / 255 + 16)
+
+static uint8_t *lz_len(uint8_t *o, size_t n) {
+    for (; n >= 255; n -= 255) *o++ = 255;
+    *o++ = (uint8_t)n;
+    return o;
+}
+
+static uint8_t *lz_emit(uint8_t *o, const uint8_t *lit, size_t nlit, size_t off, size_t mlen) {
+    uint8_t *token = o++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) o = lz_len(o, nlit - 15);
+    memcpy(o, lit, nlit);
+    o += nlit;
+    if (!mlen) return o;   /* the closing literals */
+    *o++ = (uint8_t)off;
+    *o++ = (uint8_t)(off >> 8);
+    mlen -= 4;
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15) o = lz_len(o, mlen - 15);
+    return o;
+}
+
+/* Pack src[0..n) into dst (LZ_BOUND(n) bytes); returns the packed length */
+static size_t lz_pack(const uint8_t *src, size_t n, uint8_t *dst) {
+    static uint32_t table[1 << LZ_HASH_BITS];   // position + 1 of the last 4-byte run seen
+    uint32_t raw = (uint32_t)n;
+    memcpy(dst, &raw, sizeof(raw));
+    uint8_t *o = dst + sizeof(raw);
+    memset(table, 0, sizeof(table));
+    size_t anchor = 0, i = 0;
+    while (n >= 13 && i < n - 12) {
+        uint32_t seq, cand;
+        memcpy(&seq, src + i, sizeof(seq));
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = (uint32_t)i + 1;
+        if (ref-- == 0 || i - ref > 65535 || (memcpy(&cand, src + ref, sizeof(cand)), cand != seq)) {
+            ++i;
+            continue;
+        }
+        size_t mlen = 4;
+        while (i + mlen < n - 5 && src[ref + mlen] == src[i + mlen]) ++mlen;
+        o = lz_emit(o, src + anchor, i - anchor, i - ref, mlen);
+        i += mlen;
+        anchor = i;
+    }
+    o = lz_emit(o, src + anchor, n - anchor, 0, 0);
+    return (size_t)(o - dst);
+}
+
+/* Unpack a whole lz_pack message into a new NUL-terminated buffer; NULL if
+ * it is corrupt (or memory ran out) */
+static char *lz_unpack(const uint8_t *src, size_t n, uint32_t *raw_len) {
+    uint32_t raw;
+    if (n < sizeof(raw)) return NULL;
+    memcpy(&raw, src, sizeof(raw));
+    uint8_t *dst = malloc((size_t)raw + 1);
+    if (!dst) return NULL;
+    size_t i = sizeof(raw), o = 0;
+    while (i < n) {
+        uint8_t token = src[i++];
+        size_t nlit = token >> 4, mlen = (token & 15u) + 4;
+        if (nlit == 15) {
+            for (uint8_t b = 255; b == 255 && i < n; nlit += b) b = src[i++];
+        }
+        if (nlit > n - i || nlit > raw - o) break;
+        memcpy(dst + o, src + i, nlit);
+        i += nlit;
+        o += nlit;
+        if (i == n) {
+            if (o != raw) break;
+            dst[raw] = '\0';
+            *raw_len = raw;
+            return (char *)dst;
+        }
+        if (n - i < 2) break;
+        size_t off = src[i] | (size_t)src[i + 1] << 8;
+        i += 2;
+        if (mlen == 19) {
+            for (uint8_t b = 255; b == 255 && i < n; mlen += b) b = src[i++];
         }
-        left -= (size_t)r;
-        p += r;
+        if (off == 0 || off > o || mlen > raw - o) break;
+        for (size_t j = 0; j < mlen; ++j, ++o) dst[o] = dst[o - off];   /* may overlap */
+    }
+    free(dst);
+    return NULL;
+}
+
+/* Load the next chunk of m into the next free slot; any node may do this,
+ * node 0 is the only injector today. Returns 1 once m is fully sent. */
+static int apple_add(apple_t *a, node_t *self, outmsg_t *m) {
+    if (a->used >= MAX_SLOTS) return -1;
+    slot_t *sl = &a->slot[a->used++];
+    uint32_t len = m->len - m->off < CHUNK_MAX ? m->len - m->off : CHUNK_MAX;
+    sl->dest   = m->dest;
+    if (m->dest == DEST_GROUP) sl->group = *m->group;
+    sl->origin = self->id;
+    sl->seq    = m->seq;
+    sl->hops   = 0;
+    sl->t_sent = m->t_sent;
+    sl->prio   = m->prio;
+    sl->lz     = m->lz;
+    sl->len    = len;
+    sl->offset = m->off;
+    sl->total  = m->len;
+    memcpy(sl->text, m->text + m->off, len);
+    sl->text[len] = '\0';
+    m->off += len;
+    return m->off == m->len;
+}
+
+/* Free slot i, keeping the occupied slots packed */
+static void apple_remove(apple_t *a, int i) {
+    if (i != a->used - 1) a->slot[i] = a->slot[a->used - 1];
+    --a->used;
+}
+
+/* Push out everything queued on the outbound links. Under --watchdog a dead
+ * neighbour only takes its link down; the node keeps forwarding elsewhere. */
+static int node_flush(node_t *self) {
+    for (int i = 0; i < self->nout; ++i) {
+        link_t *l = &self->out[i];
+        if (l->off == l->len || link_flush(l) == 0) continue;
+        if (!g_watchdog_ns) return -1;
+        link_down(l);
+    }
+    return 0;
+}
+
+/* Set up an empty node; links are added by whoever builds the ring */
+static int node_init(node_t *n, int id) {
+    memset(n, 0, sizeof(*n));
+    n->id = id;
+    n->stats = &g_stats[id];
+    int ctl[2];
+    if (pipe2(ctl, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+    n->ctl_rd = ctl[0];
+    n->ctl_wr = ctl[1];
+    n->wd_fd = -1;
+    if (g_trace_cap) {
+        n->trace = calloc(g_trace_cap, sizeof(*n->trace));
+        if (!n->trace) perror("trace buffer");
     }
     return 0;
 }
 
+static int node_add_link(link_t **links, int *n, chan_t ch, node_stats_t *stats) {
+    link_t *grown = realloc(*links, (size_t)(*n + 1) * sizeof(**links));
+    if (!grown) return -1;
+    memset(&grown[*n], 0, sizeof(grown[*n]));
+    grown[*n].stats = stats;
+    grown[(*n)++].ch = ch;
+    *links = grown;
+    return 0;
+}
+
+static int node_add_in(node_t *n, chan_t ch) {
+    return node_add_link(&n->in, &n->nin, ch, n->stats);
+}
+
+static int node_add_out(node_t *n, chan_t ch) {
+    return node_add_link(&n->out, &n->nout, ch, n->stats);
+}
+
+/* Close every channel; only syscalls, so the SIGINT path may use it */
+static void node_close_chans(node_t *n) {
+    for (int i = 0; i < n->nin; ++i)  chan_close(&n->in[i].ch);
+    for (int i = 0; i < n->nout; ++i) chan_close(&n->out[i].ch);
+}
+
+static void node_free(node_t *n) {
+    node_close_chans(n);
+    for (int i = 0; i < n->nin; ++i)  free(n->in[i].buf);
+    for (int i = 0; i < n->nout; ++i) free(n->out[i].buf);
+    free(n->in);
+    free(n->out);
+    free(n->trace);
+    for (int i = 0; i < n->nrx_msgs; ++i) free(n->rx_msgs[i].buf);
+    free(n->rx_msgs);
+    close(n->ctl_rd);
+    close(n->ctl_wr);
+    if (n->wd_fd >= 0) close(n->wd_fd);
+    memset(n, 0, sizeof(*n));
+}
+
 /* Trim trailing newline from fgets */
 static void chomp(char *s) {
     if (!s) return;
@@ -96,26 +1134,108 @@ static void chomp(char *s) {
     if (n && s[n-1] == '\n') s[n-1] = '\0';
 }
 
+/* Hand a node a control command (async-signal-safe) */
+static void node_poke(node_t *n, char cmd) {
+    ssize_t w = write(n->ctl_wr, &cmd, 1);
+    (void)w;   // a full control pipe already holds a pending command
+}
+
+/* Wake this process's node loop with a control command */
+static void ctl_poke(char cmd) {
+    if (g_self) node_poke(g_self, cmd);
+}
+
 /* SIGUSR1: ask children to exit gracefully */
 static void sigusr1_handler(int sig) {
     (void)sig;
-    stop_requested = 1;
+    ctl_poke('s');
 }
 
-/* SIGINT: parent broadcasts stop to children, then exits */
-static void sigint_parent_handler(int sig) {
+/* Install without SA_RESTART so node 0's blocking prompt returns EINTR and
+ * can act on the request right away */
+static void install_handler(int sig, void (*fn)(int)) {
+    struct sigaction sa = {0};
+    sa.sa_handler = fn;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(sig, &sa, NULL);
+}
+
+/* SIGUSR2: dump traces at the next safe point; node 0 relays it to the ring */
+static void sigusr2_handler(int sig) {
     (void)sig;
-    fprintf(stderr, "\n[Node 0] Caught Ctrl-C: initiating graceful shutdown...\n");
-    for (int i = 0; i < num_children; ++i) {
-        if (child_pids[i] > 0) kill(child_pids[i], SIGUSR1);
+    ctl_poke('d');
+    if (g_parent) {
+        if (g_ring_pgid > 0) kill(-g_ring_pgid, SIGUSR2);
+        for (int i = 1; i <= g_npeers; ++i) node_poke(&g_peers[i], 'd');
     }
+}
+
+/* SIGCHLD (--watchdog): node 0 reaps and respawns from its loop, not here */
+static void sigchld_handler(int sig) {
+    (void)sig;
+    ctl_poke('c');
+}
+
+/* Parent: put a new child in the ring's process group, starting the group
+ * with the first child (or again, if every member has died since) */
+static void ring_group_add(pid_t pid) {
+    if (g_ring_pgid > 0 && setpgid(pid, g_ring_pgid) == 0) return;
+    setpgid(pid, pid);
+    g_ring_pgid = pid;
+}
+
+/* Parent: stop every child with one signal to their process group (and the
+ * peer threads through their control pipes), close our ends and reap. A node
+ * still draining after TEARDOWN_GRACE_MS is killed. Never runs in a signal
+ * handler; peer threads are joined by run_ring afterwards. */
+#define TEARDOWN_GRACE_MS 5000
+static void ring_teardown(void) {
+    /* Held pending while blocked, so sigtimedwait can sleep on it below */
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld, &old);
+
+    if (g_ring_pgid > 0) kill(-g_ring_pgid, SIGUSR1);
+    for (int i = 1; i <= g_npeers; ++i) node_poke(&g_peers[i], 's');
     /* Close our ends to unblock any reads/writes */
-    if (read_fd  >= 0) close(read_fd);
-    if (write_fd >= 0) close(write_fd);
-    /* Give children a moment to exit; not using sleep(), rely on signal/pipe close */
-    /* Reap children */
-    while (wait(NULL) > 0) {}
-    _exit(0);
+    if (g_self) node_close_chans(g_self);
+
+    uint64_t deadline = now_ns() + TEARDOWN_GRACE_MS * 1000000ull;
+    while (num_children > 0) {
+        pid_t pid;
+        while (num_children > 0 && (pid = waitpid(-1, NULL, WNOHANG)) > 0) --num_children;
+        if (num_children == 0 || (pid < 0 && errno == ECHILD)) break;
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            fprintf(stderr, "[Node 0] %d node(s) still running %d ms after stop; killing them.\n",
+                    num_children, TEARDOWN_GRACE_MS);
+            if (g_ring_pgid > 0) kill(-g_ring_pgid, SIGKILL);
+            for (int i = 0; i < g_k - 1; ++i) {
+                if (child_pids[i] > 0) kill(child_pids[i], SIGKILL);
+            }
+            while (num_children > 0 && wait(NULL) > 0) --num_children;
+            break;
+        }
+        struct timespec left = {.tv_sec = (time_t)((deadline - now) / 1000000000u),
+                                .tv_nsec = (long)((deadline - now) % 1000000000u)};
+        sigtimedwait(&chld, NULL, &left);
+    }
+    num_children = 0;
+    g_ring_pgid = 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* SIGINT/SIGTERM: ask node 0's loop to stop; run_ring tears the ring down
+ * from there. A second one means that is stuck, so kill everything now. */
+static void sigint_parent_handler(int sig) {
+    if (g_interrupted) {
+        if (g_ring_pgid > 0) kill(-g_ring_pgid, SIGKILL);
+        _exit(128 + sig);
+    }
+    g_interrupted = sig;
+    ctl_poke('s');
 }
 
 /* Validate integer input (>=0 and < k) */
@@ -128,198 +1248,3587 @@ static int parse_destination(const char *s, int k, int *out) {
     return 0;
 }
 
-static void node_loop(void) {
-    /* Line-buffered stdout for readable interleaved logs */
-    setvbuf(stdout, NULL, _IOLBF, 0);
-
-    signal(SIGUSR1, sigusr1_handler);
+/* Members of the last multicast destination node 0's input named */
+static group_t g_group_in;
 
-    /* Node 0 and others share the same receive/forward pattern */
-    while (!stop_requested) {
-        apple_t a;
-        if (read_full(read_fd, &a, sizeof(a)) < 0) break;
-
-        if (a.dest == DEST_EMPTY) {
-            /* Empty apple: only node 0 injects new message; others just forward */
-            if (my_id == 0) {
-                printf("[Node %d, pid=%d] Apple returned empty. Ready for new message.\n",
-                       my_id, getpid());
-                /* Prompt the user for destination and message */
-                char dest_buf[64];
-                char text_buf[MAX_TEXT];
-
-                printf("Enter destination node [0..%d] (or 'q' to quit): ", g_k - 1);
-                fflush(stdout);
-                if (!fgets(dest_buf, sizeof(dest_buf), stdin)) {
-                    /* stdin closed; shut down */
-                    a.dest = DEST_EMPTY;
-                    /* forward empty apple so others keep flowing */
-                    if (write_full(write_fd, &a, sizeof(a)) < 0) break;
-                    continue;
-                }
-                chomp(dest_buf);
-                if (strcmp(dest_buf, "q") == 0 || strcmp(dest_buf, "Q") == 0) {
-                    /* Emulate Ctrl-C path */
-                    raise(SIGINT);
-                    break;
-                }
-                int dest;
-                if (parse_destination(dest_buf, g_k, &dest) != 0) {
-                    printf("Invalid destination '%s'. Forwarding empty apple.\n", dest_buf);
-                    /* just forward empty apple */
-                    if (write_full(write_fd, &a, sizeof(a)) < 0) break;
-                    continue;
-                }
+/* Append ids lo..hi to a scratch range list, merging with the last range
+ * when they touch; -1 once the scratch list is full */
+#define GROUP_SCRATCH 256
+static int group_add(int *lo, int *hi, int *n, int a, int b) {
+    if (*n > 0 && a >= lo[*n - 1] && a <= hi[*n - 1] + 1) {
+        if (b > hi[*n - 1]) hi[*n - 1] = b;
+        return 0;
+    }
+    if (*n == GROUP_SCRATCH) return -1;
+    lo[*n] = a;
+    hi[(*n)++] = b;
+    return 0;
+}
 
-                printf("Enter message: ");
-                fflush(stdout);
-                if (!fgets(text_buf, sizeof(text_buf), stdin)) {
-                    text_buf[0] = '\0';
-                }
-                chomp(text_buf);
+static int cmp_range(const void *a, const void *b) {
+    const int *x = a, *y = b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
 
-                a.dest   = dest;
-                a.origin = my_id;
-                strncpy(a.text, text_buf, sizeof(a.text)-1);
-                a.text[sizeof(a.text)-1] = '\0';
+/* Validate a message destination: a node id in [0, k), '*' or "all" for
+ * every node, a list like 1,3,5-9, or a hex bitmask like 0x2a (bit i = node
+ * i). A list naming a single node is just that node. */
+static int parse_target(const char *s, int k, int *out, group_t *g) {
+    int lo[GROUP_SCRATCH], hi[GROUP_SCRATCH], n = 0;
 
-                printf("[Node %d] Injecting message -> dest=%d, text=\"%s\"\n",
-                       my_id, a.dest, a.text);
-                if (write_full(write_fd, &a, sizeof(a)) < 0) break;
-            } else {
-                /* Non-zero nodes just forward an empty apple */
-                printf("[Node %d, pid=%d] Received empty apple. Forwarding.\n",
-                       my_id, getpid());
-                if (write_full(write_fd, &a, sizeof(a)) < 0) break;
+    if (strcmp(s, "*") == 0 || strcmp(s, "all") == 0) {
+        *out = DEST_ALL;
+        return 0;
+    }
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        size_t digits = strlen(s + 2);
+        if (digits == 0) return -1;
+        for (size_t p = 0; p < digits; ++p) {   /* least significant digit first */
+            int c = tolower((unsigned char)s[2 + digits - 1 - p]);
+            int v = isdigit(c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+            if (v < 0) return -1;
+            for (int b = 0; b < 4; ++b) {
+                if (!(v & (1 << b))) continue;
+                long id = 4 * (long)p + b;
+                if (id >= k || group_add(lo, hi, &n, (int)id, (int)id) < 0) return -1;
             }
-        } else {
-            /* Non-empty message in flight */
-            if (a.dest == my_id) {
-                /* We are the intended recipient */
-                printf("[Node %d, pid=%d] Received message from node %d: \"%s\"\n",
-                       my_id, getpid(), a.origin, a.text);
-                /* Process it (for demo: just print), then clear header */
-                a.dest = DEST_EMPTY;
-                a.origin = my_id;
-                a.text[0] = '\0';
-                printf("[Node %d] Processed message. Returning empty apple.\n", my_id);
-                if (write_full(write_fd, &a, sizeof(a)) < 0) break;
-            } else {
-                /* Not for us: forward unchanged */
-                printf("[Node %d, pid=%d] Forwarding message destined for node %d.\n",
-                       my_id, getpid(), a.dest);
-                if (write_full(write_fd, &a, sizeof(a)) < 0) break;
+        }
+    } else {
+        const char *p = s;
+        for (;;) {
+            char *end = NULL;
+            long a = strtol(p, &end, 10), b = a;
+            if (end == p || a < 0 || a >= k) return -1;
+            if (*end == '-') {
+                p = end + 1;
+                b = strtol(p, &end, 10);
+                if (end == p || b < a || b >= k) return -1;
             }
+            if (n == GROUP_SCRATCH) return -1;
+            lo[n] = (int)a;   /* list order is arbitrary: sorted and merged below */
+            hi[n++] = (int)b;
+            if (*end == '\0') break;
+            if (*end != ',') return -1;
+            p = end + 1;
         }
+        int pairs[GROUP_SCRATCH][2];
+        for (int i = 0; i < n; ++i) { pairs[i][0] = lo[i]; pairs[i][1] = hi[i]; }
+        qsort(pairs, (size_t)n, sizeof(pairs[0]), cmp_range);
+        int m = 0;
+        for (int i = 0; i < n; ++i) group_add(lo, hi, &m, pairs[i][0], pairs[i][1]);
+        n = m;
+    }
+    if (n == 0 || n > MAX_RANGES) return -1;
+    if (n == 1 && lo[0] == hi[0]) {
+        *out = lo[0];
+        return 0;
     }
+    g->n = (uint16_t)n;
+    for (int i = 0; i < n; ++i) {
+        g->lo[i] = (uint16_t)lo[i];
+        g->hi[i] = (uint16_t)hi[i];
+    }
+    *out = DEST_GROUP;
+    return 0;
+}
 
-    /* Graceful exit */
-    printf("[Node %d, pid=%d] Exiting.\n", my_id, getpid());
-    if (read_fd  >= 0) close(read_fd);
-    if (write_fd >= 0) close(write_fd);
-    _exit(0);
+/* Human-readable destination for log lines */
+static const char *dest_name(int dest, const group_t *g, char *buf, size_t cap) {
+    if (dest == DEST_ALL) return "all";
+    if (dest != DEST_GROUP) {
+        snprintf(buf, cap, "%d", dest);
+        return buf;
+    }
+    size_t off = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < g->n && off < cap; ++i) {
+        int w = g->lo[i] == g->hi[i]
+              ? snprintf(buf + off, cap - off, "%s%d", i ? "," : "", g->lo[i])
+              : snprintf(buf + off, cap - off, "%s%d-%d", i ? "," : "", g->lo[i], g->hi[i]);
+        if (w < 0) break;
+        off += (size_t)w;
+    }
+    return buf;
 }
 
-int main(void) {
-    /* Make stdout line-buffered for all processes so logs appear quickly */
-    setvbuf(stdout, NULL, _IOLBF, 0);
+/* Outcomes of asking node 0's input source for the next message */
+#define NEXT_MESSAGE 0   // dest/text/len filled in
+#define NEXT_SKIP    1   // nothing to send this lap; forward the empty apple
+#define NEXT_QUIT    2   // shut the ring down
+#define NEXT_IDLE    3   // --listen: nothing queued; park the apple until a client sends
 
-    printf("=== One Bad Apple (CIS 452) ===\n");
-    int k;
-    printf("Enter number of nodes k (2..%d): ", MAX_K);
-    fflush(stdout);
-    if (scanf("%d", &k) != 1 || k < 2 || k > MAX_K) {
-        fprintf(stderr, "Invalid k.\n");
-        return 1;
+/* fgets that rides out signals (e.g., a SIGUSR2 dump) instead of reporting EOF */
+static char *read_line(char *buf, size_t cap) {
+    for (;;) {
+        if (fgets(buf, (int)cap, stdin)) return buf;
+        if (!ferror(stdin) || errno != EINTR) return NULL;
+        clearerr(stdin);
+        node_control(g_self);
+        if (g_self->stop) return NULL;
     }
-    /* Consume the newline left by scanf so that fgets works later */
-    int c;
-    while ((c = getchar()) != '\n' && c != EOF) {}
+}
 
-    g_k = k;
+/* Prompt the user for destination and message (one line, up to a slot's worth) */
+static int prompt_message(int *dest, const char **text, size_t *len) {
+    static char text_buf[MAX_TEXT];
+    char dest_buf[256];
 
-    /* Allocate k pipes: pipe[i] used from node i -> (i+1)%k */
-    int pipes[MAX_K][2];
-    for (int i = 0; i < k; ++i) {
-        if (pipe(pipes[i]) < 0) {
-            perror("pipe");
-            return 1;
-        }
+    /* Apples handled this pass must not wait on the user */
+    if (node_flush(g_self) < 0) return NEXT_QUIT;
+    if (g_slots > 1)
+        printf("Enter destination node [0..%d], '*' or a list like 1,3-5 "
+               "(blank to send, 'q' to quit): ", g_k - 1);
+    else
+        printf("Enter destination node [0..%d], '*' or a list like 1,3-5 "
+               "(or 'q' to quit): ", g_k - 1);
+    fflush(stdout);
+    if (!read_line(dest_buf, sizeof(dest_buf))) {
+        /* stdin closed; forward empty apple so others keep flowing */
+        return NEXT_SKIP;
+    }
+    chomp(dest_buf);
+    if (strcmp(dest_buf, "q") == 0 || strcmp(dest_buf, "Q") == 0) return NEXT_QUIT;
+    if (dest_buf[0] == '\0' && g_slots > 1) return NEXT_SKIP;  /* send what we have */
+    if (parse_target(dest_buf, g_k, dest, &g_group_in) != 0) {
+        printf("Invalid destination '%s'. Forwarding empty apple.\n", dest_buf);
+        return NEXT_SKIP;
     }
 
-    /* Fork k-1 children (node ids 1..k-1). Parent is node 0 */
-    for (int i = 1; i < k; ++i) {
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
-            return 1;
-        } else if (pid == 0) {
-            /* Child process: becomes node i */
-            g_parent = 0;
-            my_id = i;
-
-            /* Close all unused fds; keep read from left neighbor and write to self pipe */
-            for (int j = 0; j < k; ++j) {
-                if (j == (i - 1 + k) % k) {
-                    /* keep pipes[j][0] open for reading */
-                } else {
-                    close(pipes[j][0]);
-                }
-                if (j == i) {
-                    /* keep pipes[j][1] open for writing */
-                } else {
-                    close(pipes[j][1]);
-                }
+    printf("Enter message: ");
+    fflush(stdout);
+    if (!read_line(text_buf, sizeof(text_buf))) {
+        text_buf[0] = '\0';
+    }
+    chomp(text_buf);
+    *text = text_buf;
+    *len  = strlen(text_buf);
+    return NEXT_MESSAGE;
+}
+
+/* Class of the message next_message just returned, like g_group_in */
+static int g_prio_in = PRIO_BULK;
+
+/* Split one "[!]dest<TAB>text" record (NUL-terminated, n bytes) in place:
+ * 0 = a message, -1 = blank, a comment, or malformed (reported, skipped) */
+static int record_parse(char *line, size_t n, const char *src, long line_no,
+                        int *dest, const char **text, size_t *len) {
+    if (line[0] == '\0' || line[0] == '#') return -1;
+    g_prio_in = line[0] == '!' ? PRIO_URGENT : PRIO_BULK;
+    if (n > UINT32_MAX) {
+        fprintf(stderr, "[Node 0] %s line %ld: longer than 4 GiB, skipped.\n", src, line_no);
+        return -1;
+    }
+    char *tab = strchr(line, '\t');
+    if (!tab) {
+        fprintf(stderr, "[Node 0] %s line %ld: missing TAB, skipped.\n", src, line_no);
+        return -1;
+    }
+    *tab = '\0';
+    if (parse_target(line + (g_prio_in == PRIO_URGENT), g_k, dest, &g_group_in) != 0) {
+        fprintf(stderr, "[Node 0] %s line %ld: invalid destination '%s', skipped.\n",
+                src, line_no, line);
+        return -1;
+    }
+    *text = tab + 1;
+    *len  = (size_t)(line + n - (tab + 1));
+    return 0;
+}
+
+/* getline on -b that rides out signals the way read_line does. A signal
+ * between reads makes getline fail, and one mid-line makes it hand back the
+ * part it had; in both cases the read picks up where it stopped. Returns
+ * the line's length, -1 at end of input, or -2 when node 0 must act first
+ * (a stop request, or a child to respawn). A line cut short is kept for
+ * the next call. */
+static ssize_t batch_getline(char **line, size_t *cap) {
+    static char  *rest = NULL;
+    static size_t rest_cap = 0;
+    static size_t have = 0;
+    for (;;) {
+        ssize_t n = getline(have ? &rest : line, have ? &rest_cap : cap, g_batch);
+        if (n > 0 && have) {
+            if (*cap < have + (size_t)n + 1) {
+                char *grown = realloc(*line, have + (size_t)n + 1);
+                if (!grown) {
+                    perror("batch line");
+                    return -1;
+                }
+                *line = grown;
+                *cap = have + (size_t)n + 1;
+            }
+            memcpy(*line + have, rest, (size_t)n + 1);
+        }
+        if (n > 0) {
+            size_t got = have + (size_t)n;
+            if ((*line)[got - 1] == '\n' || !ferror(g_batch) || errno != EINTR) {
+                have = 0;
+                return (ssize_t)got;
+            }
+            have = got;
+        } else if (!ferror(g_batch) || errno != EINTR) {
+            /* The end of the input; a last line without a newline still counts */
+            size_t got = have;
+            have = 0;
+            return got ? (ssize_t)got : -1;
+        }
+        clearerr(g_batch);
+        node_control(g_self);
+        if (g_self->stop || g_self->reap) return -2;
+    }
+}
+
+/* Next valid batch record; malformed lines are reported and skipped. Lines
+ * may be any length: the text points into getline's buffer, which stays put
+ * until node 0 has cut the whole message into chunks and asks again. */
+static int batch_next(int *dest, const char **text, size_t *len) {
+    static char  *line = NULL;
+    static size_t line_cap = 0;
+    static long   line_no = 0;
+    ssize_t n;
+
+    while ((n = batch_getline(&line, &line_cap)) >= 0) {
+        ++line_no;
+        if (n > 0 && line[n - 1] == '\n') line[--n] = '\0';
+        if (record_parse(line, (size_t)n, "batch", line_no, dest, text, len) == 0)
+            return NEXT_MESSAGE;
+    }
+    /* A dead child: let this apple go empty so the loop respawns it */
+    return n == -2 && !g_self->stop ? NEXT_SKIP : NEXT_QUIT;
+}
+
+/* Benchmark generator: fixed-size payloads to the configured destination pattern */
+static int bench_next(int *dest, const char **text, size_t *len) {
+    static uint32_t rng = 2463534242u;
+    static char    *buf = NULL;
+    static size_t   buf_cap = 0;
+    if (g_bench_sent >= g_bench_n) return NEXT_QUIT;
+    if (buf_cap < (size_t)g_bench_size + 1) {
+        char *grown = realloc(buf, (size_t)g_bench_size + 1);
+        if (!grown) {
+            perror("bench payload");
+            return NEXT_QUIT;
+        }
+        buf = grown;
+        buf_cap = (size_t)g_bench_size + 1;
+    }
+
+    switch (g_bench_dest) {
+    case DEST_RR:     *dest = (g_bench_sent + 1) % g_k; break;
+    case DEST_FAR:    *dest = g_k - 1; break;
+    case DEST_RANDOM:
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        *dest = (int)(rng % (uint32_t)g_k);
+        break;
+    default:          *dest = g_bench_dest; break;
+    }
+    /* Spread --urgent evenly: message i is urgent when i * pct / 100 steps up */
+    g_prio_in = (g_bench_sent + 1) * g_urgent_pct / 100 != g_bench_sent * g_urgent_pct / 100
+                ? PRIO_URGENT : PRIO_BULK;
+    for (int i = 0; i < g_bench_size; ++i) buf[i] = (char)('a' + (g_bench_sent + i) % 26);
+    buf[g_bench_size] = '\0';
+    *text = buf;
+    *len  = (size_t)g_bench_size;
+    ++g_bench_sent;
+    return NEXT_MESSAGE;
+}
+
+/* --listen PATH: node 0 keeps the ring up and takes batch-format records
+ * from any number of clients on a Unix stream socket, so sessions share one
+ * warm ring instead of building their own. A client's bytes are buffered
+ * until a whole line is in. Apples with nothing to carry wait at node 0
+ * (parked) rather than lap an idle ring. */
+#define MAX_CLIENTS 64
+#define CLIENT_HIGH (64 * 1024)   // stop reading a client with this much still unsent
+typedef struct {
+    int    open;        // slot in use; fd may be closed already with input left
+    int    fd;          // -1 once the client has hung up
+    int    id;
+    char  *buf;
+    size_t off, len, cap;
+    long   line_no;
+    long   records;
+} client_t;
+static const char *g_listen_path = NULL;
+static int      g_listen_fd = -1;
+static client_t g_clients[MAX_CLIENTS];
+static int      g_client_ids = 0;      // handed out so far, for log lines
+static int      g_client_rr = 0;       // where daemon_next looks first
+static int      g_parked[MAX_TOKENS];  // tokens waiting at node 0 for input
+static int      g_nparked = 0;
+
+static int daemon_open(const char *path) {
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+    /* A socket left behind by a ring that died can go; anything else stays */
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    g_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_listen_fd < 0 || bind(g_listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        listen(g_listen_fd, SOMAXCONN) < 0) {
+        perror(path);
+        if (g_listen_fd >= 0) close(g_listen_fd);
+        g_listen_fd = -1;
+        return -1;
+    }
+    g_listen_path = path;
+    return 0;
+}
+
+static void client_free(client_t *c) {
+    log_deliver("[Node 0] Client %d done: %ld message(s).\n", c->id, c->records);
+    if (c->fd >= 0) close(c->fd);
+    free(c->buf);
+    memset(c, 0, sizeof(*c));
+}
+
+static void daemon_close(void) {
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (g_clients[i].open) client_free(&g_clients[i]);
+    }
+    if (g_listen_fd >= 0) {
+        close(g_listen_fd);
+        unlink(g_listen_path);
+    }
+    g_listen_fd = -1;
+    g_nparked = 0;
+}
+
+/* Does client c have a whole record waiting (a line, or the tail it hung up on)? */
+static int client_ready(const client_t *c) {
+    size_t avail = c->len - c->off;
+    return c->open && ((c->fd < 0 && avail) || memchr(c->buf + c->off, '\n', avail));
+}
+
+/* Next record from the clients, one from each in turn so nobody waits behind
+ * a big upload; a client's own records keep their order */
+static int daemon_next(int *dest, const char **text, size_t *len) {
+    static char  *line = NULL;
+    static size_t line_cap = 0;
+    for (int tries = 0; tries < MAX_CLIENTS; ) {
+        client_t *c = &g_clients[g_client_rr];
+        if (!client_ready(c)) {
+            if (c->open && c->fd < 0) client_free(c);   /* hung up, all sent */
+            g_client_rr = (g_client_rr + 1) % MAX_CLIENTS;
+            ++tries;
+            continue;
+        }
+        char  *start = c->buf + c->off;
+        char  *nl = memchr(start, '\n', c->len - c->off);
+        size_t n = nl ? (size_t)(nl - start) : c->len - c->off;
+        if (line_cap < n + 1) {
+            char *grown = realloc(line, n + 1);
+            if (!grown) {
+                perror("client record");
+                return NEXT_IDLE;
+            }
+            line = grown;
+            line_cap = n + 1;
+        }
+        memcpy(line, start, n);
+        line[n] = '\0';
+        c->off += n + (nl != NULL);
+        char src[32];
+        snprintf(src, sizeof(src), "client %d", c->id);
+        if (record_parse(line, n, src, ++c->line_no, dest, text, len) == 0) {
+            ++c->records;
+            g_client_rr = (g_client_rr + 1) % MAX_CLIENTS;
+            return NEXT_MESSAGE;
+        }
+    }
+    return NEXT_IDLE;
+}
+
+/* Listening socket (while a slot is free) and every client we may read */
+static int daemon_pollfds(struct pollfd *p) {
+    int n = 0, full = 1;
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        const client_t *c = &g_clients[i];
+        if (!c->open) full = 0;
+        if (!c->open || c->fd < 0) continue;
+        /* Let a fast client block on its socket once we hold enough of its input */
+        if (c->len - c->off >= CLIENT_HIGH && client_ready(c)) continue;
+        p[n++] = (struct pollfd){.fd = c->fd, .events = POLLIN};
+    }
+    if (!full) p[n++] = (struct pollfd){.fd = g_listen_fd, .events = POLLIN};
+    return n;
+}
+
+static void daemon_accept(void) {
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        client_t *c = &g_clients[i];
+        if (c->open) continue;
+        int fd = accept4(g_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR) perror("accept");
+            return;
+        }
+        *c = (client_t){.open = 1, .fd = fd, .id = ++g_client_ids};
+        log_deliver("[Node 0] Client %d connected.\n", c->id);
+    }
+}
+
+static void client_read(client_t *c) {
+    if (c->off && c->cap - c->len < 4096) {
+        memmove(c->buf, c->buf + c->off, c->len - c->off);
+        c->len -= c->off;
+        c->off = 0;
+    }
+    if (c->len == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : CLIENT_HIGH;
+        char *grown = realloc(c->buf, cap);
+        if (!grown) {
+            perror("client buffer");
+            return;
+        }
+        c->buf = grown;
+        c->cap = cap;
+    }
+    ssize_t r = recv(c->fd, c->buf + c->len, c->cap - c->len, 0);
+    if (r > 0) {
+        c->len += (size_t)r;
+        return;
+    }
+    if (r < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    /* Hung up: whatever it sent before that still goes out */
+    close(c->fd);
+    c->fd = -1;
+    if (c->off == c->len) client_free(c);
+}
+
+/* --submit PATH: hand the records in f to a ring started with --listen PATH */
+static int submit_records(const char *path, FILE *f) {
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long.\n", path);
+        return 1;
+    }
+    strcpy(sa.sun_path, path);
+    uint64_t start = now_ns();
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    uint64_t connect_ns = now_ns() - start;
+    signal(SIGPIPE, SIG_IGN);   /* a ring that went away shows up as EPIPE */
+    char   buf[1 << 16];
+    size_t n;
+    unsigned long long sent = 0;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        for (size_t off = 0; off < n; ) {
+            ssize_t w = send(fd, buf + off, n - off, 0);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                perror("send");
+                close(fd);
+                return 1;
+            }
+            off += (size_t)w;
+        }
+        sent += n;
+    }
+    int status = ferror(f) ? 1 : 0;
+    if (status) perror("read");
+    close(fd);
+    fprintf(stderr, "Submitted %llu bytes to %s (connected in %.1f us).\n",
+            sent, path, (double)connect_ns / 1e3);
+    return status;
+}
+
+static int next_message(int *dest, const char **text, size_t *len) {
+    if (g_bench_n) return bench_next(dest, text, len);
+    if (g_listen_fd >= 0) return daemon_next(dest, text, len);
+    uint64_t asked = now_ns();
+    int rc = g_batch ? batch_next(dest, text, len) : prompt_message(dest, text, len);
+    /* Time spent waiting on input isn't time the ring lost tokens in */
+    uint64_t waited = now_ns() - asked;
+    for (int t = 0; t < g_tokens; ++t) {
+        if (g_token_sent[t]) g_token_sent[t] += waited;
+    }
+    return rc;
+}
+
+/* Read-ahead injection queues, one FIFO per class. With -b, --listen or
+ * --bench --urgent, node 0 takes up to PRIO_WINDOW records (or
+ * PRIO_WINDOW_BYTES of text) off its input ahead of the ring, so an urgent
+ * record can overtake the bulk ones read before it. Latency counts from
+ * the moment a record was read, queueing included. */
+#define PRIO_WINDOW       256
+#define PRIO_WINDOW_BYTES (4u << 20)
+typedef struct {
+    char    *text;
+    size_t   len;
+    int      dest;
+    group_t  group;
+    uint64_t t_in;
+} queued_t;
+typedef struct {
+    queued_t *q;
+    int       head, len, cap;
+} prio_queue_t;
+static int          g_lookahead = 0;     // queue input at all (else straight from the source)
+static int          g_reserve = 0;       // --reserve: slots per apple only urgent messages take
+static prio_queue_t g_queue[NPRIO];
+static queued_t     g_taken[NPRIO];      // being sent by node 0's tx_msg[class]
+static int          g_queued = 0;        // records in every queue
+static size_t       g_queued_bytes = 0;
+static int          g_input_done = 0;    // the source has nothing more, ever
+
+static void queue_reset(void) {
+    for (int c = 0; c < NPRIO; ++c) {
+        prio_queue_t *q = &g_queue[c];
+        for (int i = 0; i < q->len; ++i) free(q->q[(q->head + i) % q->cap].text);
+        free(q->q);
+        free(g_taken[c].text);
+        memset(q, 0, sizeof(*q));
+        memset(&g_taken[c], 0, sizeof(g_taken[c]));
+    }
+    g_queued = 0;
+    g_queued_bytes = 0;
+    g_input_done = 0;
+}
+
+static int queue_push(int c, int dest, const char *text, size_t len) {
+    prio_queue_t *q = &g_queue[c];
+    if (q->len == q->cap) {
+        int cap = q->cap ? 2 * q->cap : 64;
+        queued_t *grown = malloc((size_t)cap * sizeof(*grown));
+        if (!grown) return -1;
+        for (int i = 0; i < q->len; ++i) grown[i] = q->q[(q->head + i) % q->cap];
+        free(q->q);
+        q->q = grown;
+        q->head = 0;
+        q->cap = cap;
+    }
+    queued_t *e = &q->q[(q->head + q->len) % q->cap];
+    e->text = malloc(len + 1);
+    if (!e->text) return -1;
+    memcpy(e->text, text, len + 1);
+    e->len = len;
+    e->dest = dest;
+    if (dest == DEST_GROUP) e->group = g_group_in;
+    e->t_in = now_ns();
+    ++q->len;
+    ++g_queued;
+    g_queued_bytes += len;
+    return 0;
+}
+
+/* Would reading -b input block right now? Only the kernel side is checked,
+ * so lines already in stdio's buffer may wait for a later fill. */
+static int input_ready(FILE *f) {
+    struct pollfd p = {.fd = fileno(f), .events = POLLIN};
+    return poll(&p, 1, 0) > 0;
+}
+
+/* Top the queues up from the input. Blocks (on -b) only while they are
+ * empty and no message is half sent, so a slow producer never holds up
+ * what is already queued or the rest of a chunked message. */
+static void queue_fill(void) {
+    /* A dead child is respawned before node 0 reads again */
+    if (g_self->reap || g_self->stop) return;
+    while (!g_input_done && g_queued < PRIO_WINDOW && g_queued_bytes < PRIO_WINDOW_BYTES) {
+        if (g_batch && (g_queued || g_self->tx_msg[PRIO_URGENT].text ||
+                        g_self->tx_msg[PRIO_BULK].text) && !input_ready(g_batch)) break;
+        int dest;
+        const char *text;
+        size_t len;
+        int rc = next_message(&dest, &text, &len);
+        if (rc == NEXT_IDLE || rc == NEXT_SKIP) break;
+        if (rc != NEXT_MESSAGE) {
+            g_input_done = 1;
+            break;
+        }
+        if (queue_push(g_prio_in, dest, text, len) != 0)
+            fprintf(stderr, "[Node 0] Out of memory; dropping a %zu-byte message.\n", len);
+    }
+}
+
+/* Start node 0's next message of class c in m: NEXT_MESSAGE, NEXT_SKIP when
+ * none of that class is waiting but others may be, or what the input said */
+static int inject_next(node_t *self, int c, outmsg_t *m) {
+    const char *text;
+    size_t len;
+    int dest;
+    if (!g_lookahead) {
+        /* Interactive and plain --bench: everything is bulk, read on demand */
+        if (c != PRIO_BULK) return NEXT_SKIP;
+        int rc = next_message(&dest, &text, &len);
+        if (rc != NEXT_MESSAGE) return rc;
+        *m = (outmsg_t){.text = text, .len = (uint32_t)len, .dest = dest,
+                        .group = &g_group_in, .prio = PRIO_BULK, .t_sent = now_ns()};
+    } else {
+        queue_fill();
+        prio_queue_t *q = &g_queue[c];
+        if (q->len == 0) {
+            if (g_queued || !g_input_done) return g_listen_fd >= 0 && !g_queued ? NEXT_IDLE
+                                                                                : NEXT_SKIP;
+            return NEXT_QUIT;
+        }
+        /* The previous message of this class is fully loaded by now */
+        free(g_taken[c].text);
+        g_taken[c] = q->q[q->head];
+        q->head = (q->head + 1) % q->cap;
+        --q->len;
+        --g_queued;
+        g_queued_bytes -= g_taken[c].len;
+        text = g_taken[c].text;
+        len = g_taken[c].len;
+        dest = g_taken[c].dest;
+        *m = (outmsg_t){.text = text, .len = (uint32_t)len, .dest = dest,
+                        .group = &g_taken[c].group, .prio = c, .t_sent = g_taken[c].t_in};
+    }
+    m->seq = self->next_seq++;
+    if (g_bench_recs && m->seq < (unsigned)g_bench_n) g_bench_recs[m->seq].prio = (uint32_t)c;
+    if (g_lz_min && len >= g_lz_min && len <= LZ_MAX) {
+        /* Same lifetime as m->text: replaced when class c starts its next message */
+        static uint8_t *packed[NPRIO];
+        static size_t   packed_cap[NPRIO];
+        size_t need = LZ_BOUND(len);
+        if (packed_cap[c] < need) {
+            uint8_t *grown = realloc(packed[c], need);
+            if (grown) {
+                packed[c] = grown;
+                packed_cap[c] = need;
+            }
+        }
+        if (packed_cap[c] >= need) {
+            size_t plen = lz_pack((const uint8_t *)text, len, packed[c]);
+            g_lz_raw += len;
+            g_lz_wire += plen < len ? plen : len;
+            if (plen < len) {   /* incompressible text goes as is */
+                m->text = (const char *)packed[c];
+                m->len = (uint32_t)plen;
+                m->lz = 1;
+            }
+        }
+    }
+    char dbuf[128];
+    const char *dname = g_log >= LOG_TRACE ? dest_name(dest, m->group, dbuf, sizeof(dbuf)) : "";
+    const char *cname = c == PRIO_URGENT ? "urgent " : "";
+    if (len <= CHUNK_MAX) {
+        log_trace("[Node %d] Injecting %smessage -> dest=%s, text=\"%s\"\n",
+                  self->id, cname, dname, text);
+    } else {
+        log_trace("[Node %d] Injecting %s%zu-byte message -> dest=%s in %zu chunks\n",
+                  self->id, cname, len, dname, (len + CHUNK_MAX - 1) / CHUNK_MAX);
+    }
+    return NEXT_MESSAGE;
+}
+
+/* Hops from node a to node b going i -> i+1 */
+static int ring_dist(int a, int b) {
+    return ((b - a) % g_k + g_k) % g_k;
+}
+
+/* Pick the link an apple leaves on. nearest is the clockwise distance to the
+ * closest destination still on board (unused for an empty apple).
+ * bi: loaded apples keep the direction node 0 chose; an empty one heads back
+ * to node 0 whichever way is shorter.
+ * finger: take the longest skip link that doesn't overshoot the nearest
+ * destination (node 0 for an empty apple), so every hop at least halves the
+ * remaining distance. */
+static int node_route(const node_t *self, int used, int flags, int nearest) {
+    if (g_topology == TOPO_UNI) return 0;
+    if (g_topology == TOPO_FINGER) {
+        int d = used ? nearest : ring_dist(self->id, 0);
+        if (d == 0) d = g_k;   /* node 0 sending a lap */
+        int j = 0;
+        while (j + 1 < self->nout && (1 << (j + 1)) <= d) ++j;
+        return j;
+    }
+    if (used == 0) {
+        if (self->id == 0) return 0;   /* a lap either way */
+        return ring_dist(self->id, 0) <= ring_dist(0, self->id) ? 0 : 1;
+    }
+    return flags & APPLE_CCW ? 1 : 0;
+}
+
+/* Node 0, --topology bi: send the apple whichever way visits every slot's
+ * destination and gets back home in fewer hops */
+static int route_flags(const apple_t *a) {
+    if (g_topology == TOPO_UNI || a->used == 0) return 0;
+    int far_cw = 0, far_ccw = 0;   /* hops to the last destination each way */
+    for (int i = 0; i < a->used; ++i) {
+        int d = a->slot[i].dest;
+        int cw = d > 0 ? ring_dist(0, d) : g_k, ccw = d > 0 ? ring_dist(d, 0) : g_k;
+        if (cw > far_cw) far_cw = cw;
+        if (ccw > far_ccw) far_ccw = ccw;
+    }
+    /* ...then back the shorter way from where the last slot was delivered */
+    int home_cw = far_cw == g_k ? 0 : (far_cw < g_k - far_cw ? far_cw : g_k - far_cw);
+    int home_ccw = far_ccw == g_k ? 0 : (far_ccw < g_k - far_ccw ? far_ccw : g_k - far_ccw);
+    return far_ccw + home_ccw < far_cw + home_cw ? APPLE_CCW : 0;
+}
+
+/* Clockwise hops from this node to the closest destination among n slots */
+static int nearest_dest(const node_t *self, const int *dests, int n) {
+    int best = g_k;
+    for (int i = 0; i < n; ++i) {
+        int d = ring_dist(self->id, dests[i]);
+        if (d == 0) d = g_k;   /* our own slot still aboard means a full lap (node 0) */
+        if (d < best) best = d;
+    }
+    return best;
+}
+
+static int group_has(const group_t *g, int id) {
+    for (int i = 0; i < g->n; ++i)
+        if (id >= g->lo[i] && id <= g->hi[i]) return 1;
+    return 0;
+}
+
+/* Does node id take a copy of this slot? */
+static int slot_wants(const slot_t *sl, int id) {
+    if (sl->dest == DEST_ALL) return id != sl->origin;
+    if (sl->dest == DEST_GROUP) return group_has(&sl->group, id);
+    return sl->dest == id;
+}
+
+/* The next node clockwise from `from` this slot still has to reach: its
+ * destination, or for fan-out the next member, then back to the origin */
+static int slot_stop(const slot_t *sl, int from) {
+    if (sl->dest >= 0) return sl->dest;
+    if (sl->dest == DEST_ALL) return (from + 1) % g_k;
+    int best = sl->origin, best_d = ring_dist(from, sl->origin);
+    if (best_d == 0) best_d = g_k;
+    for (int i = 0; i < sl->group.n; ++i) {
+        int lo = sl->group.lo[i], hi = sl->group.hi[i];
+        int next = from >= lo && from < hi ? from + 1 : lo;
+        int d = ring_dist(from, next);
+        if (d > 0 && d < best_d) {
+            best = next;
+            best_d = d;
+        }
+    }
+    return best;
+}
+
+/* Queue an apple on the link node_route picks for it */
+static int node_forward(node_t *self, const apple_t *a) {
+    stat_add(&self->stats->forwarded, 1);
+    if (a->used == 0) stat_add(&self->stats->empty, 1);
+    int dests[MAX_SLOTS];
+    for (int i = 0; i < a->used; ++i) dests[i] = slot_stop(&a->slot[i], self->id);
+    int route = node_route(self, a->used, a->flags, nearest_dest(self, dests, a->used));
+    return link_send(&self->out[route], a);
+}
+
+/* --watchdog: drop reassemblies that can no longer finish. Chunks of one
+ * message leave node 0 at most a lap apart, and a lap longer than the
+ * timeout is reissued, so a message with no chunk for RX_EXPIRE_LAPS
+ * timeouts lost one on an apple the watchdog gave up on. Checked on every
+ * apple, empty ones on the fast path included. */
+#define RX_EXPIRE_LAPS 4
+static void rx_expire(node_t *self) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < self->nrx_msgs; ) {
+        inmsg_t *m = &self->rx_msgs[i];
+        if (now - m->t_last <= RX_EXPIRE_LAPS * g_watchdog_ns) {
+            ++i;
+            continue;
+        }
+        fprintf(stderr, "[Node %d] Dropping message %u from node %d: %u of %u bytes arrived, "
+                "the rest was lost.\n", self->id, m->seq, m->origin, m->got, m->total);
+        free(m->buf);
+        *m = self->rx_msgs[--self->nrx_msgs];
+    }
+}
+
+/* Fast path for the commonest frame a transit node sees, an empty apple:
+ * its 8 header bytes are copied from the inbound buffer to the outbound one
+ * as they are, with no apple_t, no decode and none of node_handle's
+ * branches. 1 = passed on, 0 = not empty after all. */
+static int node_pass_empty(node_t *self, const char *frame) {
+    apple_hdr_t hdr;
+    memcpy(&hdr, frame, sizeof(hdr));
+    if (hdr.used) return 0;
+    if (self->nrx_msgs && g_watchdog_ns) rx_expire(self);
+    trace_event(self, EV_RECV, (int)hdr.id, -1, -1, 0, 0);
+    log_trace("[Node %d, pid=%d] Received empty apple #%u. Forwarding.\n",
+              self->id, getpid(), hdr.id);
+    trace_event(self, EV_FORWARD, (int)hdr.id, -1, -1, 0, 0);
+    stat_add(&self->stats->forwarded, 1);
+    stat_add(&self->stats->empty, 1);
+    link_t *o = &self->out[self->empty_route];
+    if (link_reserve(o, sizeof(hdr)) < 0) return -1;
+    memcpy(o->buf + o->len, &hdr, sizeof(hdr));
+    o->len += sizeof(hdr);
+    ++o->frames;
+    return 1;
+}
+
+/* The stock handler: say what arrived, then sit on it for --handler-us */
+static void print_handler(int node_id, const delivery_t *d) {
+    if (d->total <= CHUNK_MAX) {
+        log_deliver("[Node %d, pid=%d] Received message from node %d on apple #%d: \"%s\"\n",
+                    node_id, getpid(), d->origin, d->apple_id, d->text);
+    } else {
+        log_deliver("[Node %d, pid=%d] Received %u-byte message from node %d on apple #%d: "
+                    "\"%.60s...\"\n", node_id, getpid(), d->total, d->origin, d->apple_id, d->text);
+    }
+    if (g_handler_ns) {
+        struct timespec ts = {.tv_sec = (time_t)(g_handler_ns / 1000000000ull),
+                              .tv_nsec = (long)(g_handler_ns % 1000000000ull)};
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+    }
+}
+
+static msg_handler_t g_handler = print_handler;
+
+/* Run the handler on d and stamp the bench record once it returns */
+static void delivery_run(int node_id, const delivery_t *d) {
+    g_handler(node_id, d);
+    node_stats_t *st = &g_stats[node_id];
+    stat_add(&st->delivered, 1);
+    int b = hist_bucket(now_ns() - d->t_sent);
+    atomic_fetch_add_explicit(&st->lat_hist[b], 1, memory_order_relaxed);
+    if (d->prio == PRIO_URGENT)
+        atomic_fetch_add_explicit(&st->lat_hist_urgent[b], 1, memory_order_relaxed);
+    if (g_bench_recs && d->seq < (unsigned)g_bench_n) {
+        /* Fan-out messages count as delivered when the last member is done */
+        bench_rec_t *rec = &g_bench_recs[d->seq];
+        unsigned long long lat = now_ns() - d->t_sent, prev = atomic_load(&rec->lat_ns);
+        while (lat > prev && !atomic_compare_exchange_weak(&rec->lat_ns, &prev, lat)) {}
+        unsigned hops = d->hops, prev_hops = atomic_load(&rec->hops);
+        while (hops > prev_hops && !atomic_compare_exchange_weak(&rec->hops, &prev_hops, hops)) {}
+    }
+}
+
+/* --worker: hand deliveries over in order; the queue drains before exit */
+static void *worker_main(void *arg) {
+    node_t *self = arg;
+    pthread_mutex_lock(&self->q_mu);
+    for (;;) {
+        while (self->q_len == 0 && !self->q_stop) pthread_cond_wait(&self->q_cv, &self->q_mu);
+        if (self->q_len == 0) break;
+        delivery_t d = self->q[self->q_head];
+        self->q_head = (self->q_head + 1) % self->q_cap;
+        --self->q_len;
+        pthread_mutex_unlock(&self->q_mu);
+        delivery_run(self->id, &d);
+        free(d.text);
+        pthread_mutex_lock(&self->q_mu);
+    }
+    pthread_mutex_unlock(&self->q_mu);
+    return NULL;
+}
+
+/* Start the handler thread with signals blocked, so they keep landing on
+ * the node's own thread (the prompt relies on fgets seeing EINTR) */
+static int worker_start(node_t *self) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_mutex_init(&self->q_mu, NULL);
+    pthread_cond_init(&self->q_cv, NULL);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&self->worker, NULL, worker_main, self);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        pthread_cond_destroy(&self->q_cv);
+        pthread_mutex_destroy(&self->q_mu);
+        errno = rc;
+        return -1;
+    }
+    self->has_worker = 1;
+    return 0;
+}
+
+/* Let the handler finish what is queued, then reap it */
+static void worker_stop(node_t *self) {
+    if (!self->has_worker) return;
+    pthread_mutex_lock(&self->q_mu);
+    self->q_stop = 1;
+    pthread_cond_signal(&self->q_cv);
+    pthread_mutex_unlock(&self->q_mu);
+    pthread_join(self->worker, NULL);
+    log_trace("[Node %d] Handler queue peaked at %d message(s).\n", self->id, self->q_peak);
+    free(self->q);
+    self->q = NULL;
+    self->q_cap = 0;
+    pthread_cond_destroy(&self->q_cv);
+    pthread_mutex_destroy(&self->q_mu);
+    self->has_worker = 0;
+}
+
+/* Append to the worker queue; text is the queue's to free from now on */
+static int worker_push(node_t *self, const delivery_t *d) {
+    pthread_mutex_lock(&self->q_mu);
+    if (self->q_len == self->q_cap) {
+        int cap = self->q_cap ? 2 * self->q_cap : 64;
+        delivery_t *grown = malloc((size_t)cap * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&self->q_mu);
+            return -1;
+        }
+        for (int i = 0; i < self->q_len; ++i) grown[i] = self->q[(self->q_head + i) % self->q_cap];
+        free(self->q);
+        self->q = grown;
+        self->q_head = 0;
+        self->q_cap = cap;
+    }
+    self->q[(self->q_head + self->q_len++) % self->q_cap] = *d;
+    if (self->q_len > self->q_peak) self->q_peak = self->q_len;
+    pthread_cond_signal(&self->q_cv);
+    pthread_mutex_unlock(&self->q_mu);
+    return 0;
+}
+
+/* A whole message reached us; sl is its last chunk, text the full payload.
+ * If owned, text is heap memory that is ours to free (or to queue). */
+static void message_done(node_t *self, int apple_id, const slot_t *sl, char *text, int owned) {
+    uint32_t total = sl->total;
+    if (sl->lz) {
+        /* Packed by node 0; we are the first to need the bytes back */
+        char *raw = lz_unpack((const uint8_t *)text, sl->total, &total);
+        if (owned) free(text);
+        if (!raw) {
+            fprintf(stderr, "[Node %d] Can't unpack message %u from node %d; dropped.\n",
+                    self->id, sl->seq, sl->origin);
+            return;
+        }
+        text = raw;
+        owned = 1;
+    }
+    delivery_t d = {.apple_id = apple_id, .origin = sl->origin, .seq = sl->seq,
+                    .hops = sl->hops, .total = total, .prio = sl->prio,
+                    .t_sent = sl->t_sent, .text = text};
+    if (self->has_worker) {
+        if (!owned) {
+            d.text = malloc((size_t)total + 1);
+            if (d.text) memcpy(d.text, text, (size_t)total + 1);
+        }
+        if (d.text && worker_push(self, &d) == 0) return;
+        if (d.text != text) free(d.text);
+        d.text = text;   /* out of memory: handle it here instead */
+    }
+    delivery_run(self->id, &d);
+    if (owned) free(text);
+}
+
+/* Consume one slot addressed to us. Unchunked messages are handled straight
+ * from the slot; chunks are copied into place until the message is complete.
+ * apple_add cuts a message into CHUNK_MAX pieces from offset 0, so a chunk
+ * that doesn't sit on that grid, disagrees with the message's total, or was
+ * seen already is dropped rather than written or counted. */
+static void node_deliver(node_t *self, int apple_id, const slot_t *sl) {
+    if (sl->len == sl->total) {
+        message_done(self, apple_id, sl, (char *)sl->text, 0);
+        return;
+    }
+    uint32_t piece = sl->offset / CHUNK_MAX;
+    if (!sl->len || sl->offset % CHUNK_MAX ||
+        sl->len != (sl->total - sl->offset < CHUNK_MAX ? sl->total - sl->offset : CHUNK_MAX)) {
+        fprintf(stderr, "[Node %d] Dropping a malformed chunk of message %u from node %d.\n",
+                self->id, sl->seq, sl->origin);
+        return;
+    }
+    int i = 0;
+    while (i < self->nrx_msgs &&
+           (self->rx_msgs[i].origin != sl->origin || self->rx_msgs[i].seq != sl->seq)) ++i;
+    if (i == self->nrx_msgs) {
+        if (self->nrx_msgs == self->rx_msgs_cap) {
+            int cap = self->rx_msgs_cap ? 2 * self->rx_msgs_cap : 8;
+            inmsg_t *grown = realloc(self->rx_msgs, (size_t)cap * sizeof(*grown));
+            if (!grown) {
+                fprintf(stderr, "[Node %d] Out of memory; dropping message %u from node %d.\n",
+                        self->id, sl->seq, sl->origin);
+                return;
+            }
+            self->rx_msgs = grown;
+            self->rx_msgs_cap = cap;
+        }
+        inmsg_t *m = &self->rx_msgs[self->nrx_msgs];
+        *m = (inmsg_t){.origin = sl->origin, .seq = sl->seq, .total = sl->total};
+        size_t pieces = ((size_t)sl->total + CHUNK_MAX - 1) / CHUNK_MAX;
+        m->buf = malloc((size_t)sl->total + 1 + (pieces + 7) / 8);
+        if (!m->buf) {
+            fprintf(stderr, "[Node %d] Out of memory; dropping message %u from node %d.\n",
+                    self->id, sl->seq, sl->origin);
+            return;
+        }
+        m->have = (uint8_t *)m->buf + sl->total + 1;
+        memset(m->have, 0, (pieces + 7) / 8);
+        ++self->nrx_msgs;
+    }
+    inmsg_t *m = &self->rx_msgs[i];
+    if (sl->total != m->total || (m->have[piece / 8] & (1u << (piece % 8)))) {
+        fprintf(stderr, "[Node %d] Dropping a %s chunk of message %u from node %d.\n", self->id,
+                sl->total != m->total ? "mismatched" : "duplicate", sl->seq, sl->origin);
+        return;
+    }
+    m->have[piece / 8] |= (uint8_t)(1u << (piece % 8));
+    memcpy(m->buf + sl->offset, sl->text, sl->len);
+    m->got += sl->len;
+    if (g_watchdog_ns) m->t_last = now_ns();
+    if (m->got < m->total) return;
+
+    m->buf[m->total] = '\0';
+    message_done(self, apple_id, sl, m->buf, 1);
+    *m = self->rx_msgs[--self->nrx_msgs];
+}
+
+/* Handle one apple that arrived at this node: 0 = carry on, 1 = node 0 is
+ * done (input exhausted or quit), -1 = the ring is broken */
+static int node_handle(node_t *self, apple_t *a) {
+    int my_id = self->id;
+    if (self->nrx_msgs && g_watchdog_ns) rx_expire(self);
+    trace_event(self, EV_RECV, a->id, a->used ? a->slot[0].dest : -1,
+                a->used ? a->slot[0].origin : -1, 0, a->used);
+
+    if (a->used == 0 && my_id != 0) {
+        /* Non-zero nodes just forward an empty apple */
+        log_trace("[Node %d, pid=%d] Received empty apple #%d. Forwarding.\n",
+                  my_id, getpid(), a->id);
+        trace_event(self, EV_FORWARD, a->id, -1, -1, 0, 0);
+        return node_forward(self, a);
+    }
+
+    /* Deliver every slot addressed to us. Unicast slots are freed here;
+     * fan-out slots ride on until they are back at their origin. */
+    int delivered = 0;
+    for (int i = 0; i < a->used; ) {
+        slot_t *sl = &a->slot[i];
+        int wants = slot_wants(sl, my_id);
+        int done = sl->dest >= 0 ? wants : my_id == sl->origin;
+        if (!wants && !done) { ++i; continue; }
+        if (wants) {
+            trace_event(self, EV_DELIVER, a->id, my_id, sl->origin, sl->seq,
+                        a->used - done);
+            /* Process it (for demo: just print) */
+            node_deliver(self, a->id, sl);
+            ++delivered;
+        }
+        if (done) apple_remove(a, i);
+        else ++i;
+    }
+
+    if (my_id != 0) {
+        if (delivered && a->used == 0) {
+            log_trace("[Node %d] Processed message. Returning empty apple.\n", my_id);
+        } else if (delivered) {
+            log_trace("[Node %d] Processed %d message(s). Forwarding apple #%d with %d left.\n",
+                      my_id, delivered, a->id, a->used);
+        } else if (a->used == 1 && a->slot[0].dest >= 0) {
+            /* Not for us: forward unchanged */
+            log_trace("[Node %d, pid=%d] Forwarding apple #%d destined for node %d.\n",
+                      my_id, getpid(), a->id, a->slot[0].dest);
+        } else {
+            log_trace("[Node %d, pid=%d] Forwarding apple #%d carrying %d messages.\n",
+                      my_id, getpid(), a->id, a->used);
+        }
+        trace_event(self, EV_FORWARD, a->id, a->used ? a->slot[0].dest : -1,
+                    a->used ? a->slot[0].origin : -1, 0, a->used);
+        return node_forward(self, a);
+    }
+
+    /* Node 0: an apple the watchdog gave up on has been replaced already */
+    int tok = a->id % MAX_TOKENS;
+    if (g_watchdog_ns && (uint32_t)a->id != g_token_id[tok]) {
+        ++g_wd.stale;
+        log_trace("[Node 0] Dropping late apple #%d; its token travels as #%u now.\n",
+                  a->id, g_token_id[tok]);
+        return 0;
+    }
+    if (g_fault_ns && g_token_sent[tok] >= g_fault_ns) {
+        uint64_t ns = now_ns() - g_fault_ns;
+        fprintf(stderr, "[Node 0] Ring recovered: apple #%d made a full lap %.3f ms after the "
+                "fault.\n", a->id, (double)ns / 1e6);
+        ++g_wd.recovered;
+        g_wd.recover_ns_sum += ns;
+        if (ns > g_wd.recover_ns_max) g_wd.recover_ns_max = ns;
+        g_fault_ns = 0;
+    }
+
+    /* The lap is over, so this apple's bytes are credit again */
+    g_inflight -= g_lap_bytes[tok];
+    g_lap_bytes[tok] = 0;
+
+    if (g_empty_left > 0 && a->used == 0) {
+        /* --bench warm-up: time bare laps before any message goes out */
+        uint64_t now = now_ns();
+        g_empty_ns += now - g_token_sent[tok];
+        ++g_empty_laps;
+        if (--g_empty_left == 0) g_run_start_ns = now;
+        g_token_sent[tok] = now;
+        trace_event(self, EV_FORWARD, a->id, -1, -1, 0, 0);
+        return node_forward(self, a);
+    }
+
+    /* Fill the free slots from the user or the batch input */
+    if (a->used == 0) {
+        log_trace("[Node %d, pid=%d] Apple #%d returned empty. Ready for new message.\n",
+                  my_id, getpid(), a->id);
+    }
+    int rc = NEXT_MESSAGE;
+    while (a->used < g_slots && !self->reap && !self->stop) {
+        /* Urgent first; bulk may not take the slots --reserve holds back */
+        outmsg_t *m = &self->tx_msg[PRIO_URGENT];
+        if (!m->text) rc = inject_next(self, PRIO_URGENT, m);
+        if (!m->text) {
+            if (a->used >= g_slots - g_reserve) break;
+            m = &self->tx_msg[PRIO_BULK];
+            if (!m->text) rc = inject_next(self, PRIO_BULK, m);
+            if (!m->text) break;
+        }
+        /* Out of credit: the message waits for a later apple. With nothing in
+         * flight anything may go, so a tiny budget can't wedge the ring. */
+        uint32_t chunk = m->len - m->off < CHUNK_MAX ? m->len - m->off : CHUNK_MAX;
+        if (g_inflight_max && g_inflight && g_inflight + chunk > g_inflight_max) break;
+        g_inflight += chunk;
+        g_lap_bytes[tok] += chunk;
+        /* Later chunks of a long message ride the next free slots and apples */
+        if (apple_add(a, self, m)) m->text = NULL;
+        trace_event(self, EV_INJECT, a->id, m->dest, my_id, m->seq, a->used);
+    }
+    if (rc == NEXT_IDLE && a->used == 0) {
+        /* --listen: wait here for a client rather than lap an idle ring */
+        g_token_sent[tok] = 0;
+        g_parked[g_nparked++] = tok;
+        log_trace("[Node 0] Parking apple #%d until a client sends.\n", a->id);
+        return 0;
+    }
+    int scripted = g_batch || g_bench_n;
+    if (rc == NEXT_QUIT && scripted && a->used == 0) {
+        trace_event(self, EV_RETIRE, a->id, -1, -1, 0, 0);
+        g_token_sent[tok] = 0;
+        if (--g_tokens_live > 0) {
+            /* Input is done but other apples may still be delivering */
+            log_trace("[Node 0] Batch input exhausted. Retiring apple #%d.\n", a->id);
+            return 0;
+        }
+        log_deliver("[Node 0] Batch input exhausted. Shutting down.\n");
+        return 1;
+    }
+    if (rc == NEXT_QUIT && !scripted) {
+        /* Same teardown as Ctrl-C, but outside the handler so traces get written */
+        fprintf(stderr, "\n[Node 0] Quit requested: initiating graceful shutdown...\n");
+        return 1;
+    }
+    a->flags = route_flags(a);
+    trace_event(self, EV_FORWARD, a->id, a->used ? a->slot[0].dest : -1,
+                a->used ? a->slot[0].origin : -1, 0, a->used);
+    g_token_sent[tok] = now_ns();
+    return node_forward(self, a);
+}
+
+/* --watchdog: note when the ring first went wrong; recovery is timed from here */
+static void watchdog_fault(void) {
+    if (g_fault_ns) return;
+    g_fault_ns = now_ns();
+    ++g_wd.faults;
+}
+
+/* Give up on token t's apple and send the token round again, empty, under a
+ * new id. Its payload bytes are credit again; whatever it carried is lost. */
+static void watchdog_reissue(node_t *self, int t) {
+    g_inflight -= g_lap_bytes[t];
+    g_lap_bytes[t] = 0;
+    g_token_id[t] += MAX_TOKENS;
+    g_token_sent[t] = now_ns();
+    ++g_wd.reissued;
+    apple_t a = {.id = (int)g_token_id[t], .used = 0};
+    trace_event(self, EV_FORWARD, a.id, -1, -1, 0, 0);
+    if (link_send(&self->out[0], &a) < 0) perror("reissue");
+}
+
+/* --listen: take new clients and their bytes, then send parked apples out
+ * with whatever records are complete now */
+static void daemon_service(node_t *self, const struct pollfd *p, int n) {
+    for (int j = 0; j < n; ++j) {
+        if (!p[j].revents) continue;
+        if (p[j].fd == g_listen_fd) {
+            daemon_accept();
+            continue;
+        }
+        for (int i = 0; i < MAX_CLIENTS; ++i) {
+            if (g_clients[i].open && g_clients[i].fd == p[j].fd) client_read(&g_clients[i]);
+        }
+    }
+    queue_fill();
+    for (int left = g_nparked; left > 0 && g_queued && !self->stop; --left) {
+        int t = g_parked[--g_nparked];
+        apple_t a = {.id = (int)g_token_id[t]};
+        int rc = node_handle(self, &a);
+        if (rc < 0) self->stop = 1;
+    }
+}
+
+/* Node 0's lap timer: reissue every token that is overdue */
+static void watchdog_tick(node_t *self) {
+    uint64_t expirations;
+    if (read(self->wd_fd, &expirations, sizeof(expirations)) < 0) return;
+    uint64_t now = now_ns();
+    for (int t = 0; t < g_tokens; ++t) {
+        if (!g_token_sent[t] || now - g_token_sent[t] <= g_watchdog_ns) continue;
+        watchdog_fault();
+        fprintf(stderr, "[Node 0] Apple #%u is %.1f ms overdue; reissuing token %d as #%u.\n",
+                g_token_id[t], (double)(now - g_token_sent[t] - g_watchdog_ns) / 1e6, t,
+                g_token_id[t] + MAX_TOKENS);
+        watchdog_reissue(self, t);
+    }
+}
+
+/* A child's end of its socket from node 0: each message is {outbound, index}
+ * with a new pipe end for that link, after node 0 respawned the neighbour */
+static void plumb_recv(node_t *self) {
+    for (;;) {
+        int32_t m[2];
+        struct iovec iov = {.iov_base = m, .iov_len = sizeof(m)};
+        union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } u;
+        struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1,
+                            .msg_control = u.buf, .msg_controllen = sizeof(u.buf)};
+        ssize_t r = recvmsg(self->wd_fd, &mh, MSG_DONTWAIT);
+        if (r == 0) {
+            /* Node 0 is gone and nobody is left to mend the ring */
+            self->stop = 1;
+            return;
+        }
+        if (r < 0) return;
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int fd;
+        memcpy(&fd, CMSG_DATA(c), sizeof(fd));
+        link_t *l = NULL;
+        if (r == sizeof(m) && m[0] && m[1] >= 0 && m[1] < self->nout) l = &self->out[m[1]];
+        if (r == sizeof(m) && !m[0] && m[1] >= 0 && m[1] < self->nin) l = &self->in[m[1]];
+        if (!l) {
+            close(fd);
+            continue;
+        }
+        link_replace(l, fd);
+        log_trace("[Node %d, pid=%d] Relinked %s link %d to a respawned neighbour.\n",
+                  self->id, getpid(), m[0] ? "outbound" : "inbound", m[1]);
+    }
+}
+
+/* Bytes of the frame at the front of buf that must be read before the next
+ * decision: the apple header, then the slot headers, then the whole frame */
+static size_t frame_want(const link_t *l) {
+    apple_hdr_t hdr;
+    if (l->len < sizeof(hdr)) return sizeof(hdr);
+    memcpy(&hdr, l->buf, sizeof(hdr));
+    size_t want = sizeof(hdr) + hdr.used * sizeof(slot_hdr_t);
+    if (hdr.used > MAX_SLOTS || l->len < want) return want;
+    for (uint32_t i = 0; i < hdr.used; ++i) {
+        slot_hdr_t sh;
+        memcpy(&sh, l->buf + sizeof(hdr) + i * sizeof(sh), sizeof(sh));
+        want += sh.ranges * RANGE_BYTES + sh.len;
+    }
+    return want;
+}
+
+/* --splice receive path for transit nodes on pipes. Read exactly up to the
+ * slot headers; if nothing is for us, bump the hop counts, queue just the
+ * headers on out[0] and splice() the payload across, so the body never
+ * enters user space. Anything else is read in full and handled normally. */
+static int node_receive_splice(node_t *self, link_t *l) {
+    if (!l->buf) {
+        l->buf = malloc(RX_BYTES);
+        if (!l->buf) return -1;
+        l->cap = RX_BYTES;
+    }
+    while (!self->stop) {
+        if (l->splice_left) {
+            link_t *o = &self->out[l->splice_to];
+            /* Headers must be out ahead of the payload */
+            if (link_flush(o) < 0) return -1;
+            l->splice_out = o->off != o->len;
+            if (l->splice_out) return 0;
+            ssize_t n = splice(l->ch.fd, NULL, o->ch.fd, NULL, l->splice_left,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0) return -1;
+            if (n > 0) {
+                ++o->calls;
+                stat_add(&l->stats->bytes_in, (uint64_t)n);
+                stat_add(&o->stats->bytes_out, (uint64_t)n);
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN) return -1;
+                /* Either side may be the one that would block */
+                int avail = 0;
+                l->splice_out = ioctl(l->ch.fd, FIONREAD, &avail) == 0 && avail > 0;
+                return 0;
+            }
+            l->splice_left -= (size_t)n;
+            continue;
+        }
+
+        size_t want = frame_want(l);
+        if (want > MAX_FRAME) {
+            fprintf(stderr, "[Node %d] Malformed apple frame; leaving the ring.\n", self->id);
+            return -1;
+        }
+        if (l->len < want) {
+            ssize_t r = chan_recv(&l->ch, l->buf + l->len, want - l->len);
+            if (r < 0 && errno == EAGAIN) return 0;
+            if (r <= 0) return -1;
+            ++l->calls;
+            l->len += (size_t)r;
+            stat_add(&l->stats->bytes_in, (uint64_t)r);
+            continue;
+        }
+
+        int passed = node_pass_empty(self, l->buf);
+        if (passed < 0) return -1;
+        if (passed) {
+            l->len = 0;
+            ++l->frames;
+            continue;
+        }
+
+        apple_hdr_t hdr;
+        memcpy(&hdr, l->buf, sizeof(hdr));
+        size_t hlen = sizeof(hdr) + hdr.used * sizeof(slot_hdr_t);
+        if (l->len == hlen && want > hlen) {
+            /* Slot headers in, payload still in the pipe: is any of it ours? */
+            int mine = 0, dests[MAX_SLOTS];
+            slot_hdr_t sh;
+            for (uint32_t i = 0; i < hdr.used; ++i) {
+                memcpy(&sh, l->buf + sizeof(hdr) + i * sizeof(sh), sizeof(sh));
+                mine |= sh.dest == self->id || sh.dest < 0;   /* fan-out: decode it */
+                dests[i] = sh.dest;
+            }
+            if (!mine) {
+                for (uint32_t i = 0; i < hdr.used; ++i) {
+                    char *p = l->buf + sizeof(hdr) + i * sizeof(sh);
+                    memcpy(&sh, p, sizeof(sh));
+                    if (i == 0) {
+                        trace_event(self, EV_RECV, (int)hdr.id, sh.dest, sh.origin, 0, (int)hdr.used);
+                        trace_event(self, EV_FORWARD, (int)hdr.id, sh.dest, sh.origin, 0, (int)hdr.used);
+                        if (hdr.used == 1) {
+                            log_trace("[Node %d, pid=%d] Forwarding apple #%u destined for node %d.\n",
+                                      self->id, getpid(), hdr.id, sh.dest);
+                        } else {
+                            log_trace("[Node %d, pid=%d] Forwarding apple #%u carrying %u messages.\n",
+                                      self->id, getpid(), hdr.id, (unsigned)hdr.used);
+                        }
+                    }
+                    ++sh.hops;
+                    memcpy(p, &sh, sizeof(sh));
+                }
+                l->splice_to = node_route(self, hdr.used, hdr.flags,
+                                          nearest_dest(self, dests, hdr.used));
+                if (link_send_raw(&self->out[l->splice_to], l->buf, hlen) < 0) return -1;
+                stat_add(&self->stats->forwarded, 1);
+                l->splice_left = want - hlen;
+                l->len = 0;
+                ++l->frames;
+                continue;
+            }
+        }
+        if (l->len < want) continue;
+
+        /* A whole frame that is for us (or empty): the usual path */
+        apple_t a;
+        if (apple_decode(l->buf, l->len, &a) <= 0) {
+            fprintf(stderr, "[Node %d] Malformed apple frame; leaving the ring.\n", self->id);
+            return -1;
+        }
+        l->len = 0;
+        ++l->frames;
+        int rc = node_handle(self, &a);
+        if (rc < 0) return -1;
+        if (rc > 0) self->stop = 1;
+    }
+    return 0;
+}
+
+/* Pull what has arrived on an inbound link and handle every complete frame.
+ * A shm ring only wakes us again once we have seen it empty, so keep
+ * draining it until it reports EAGAIN; pipes are level-triggered. */
+static int node_receive(node_t *self, link_t *l) {
+    if (g_splice && self->id != 0 && l->ch.kind == CHAN_PIPE) {
+        return node_receive_splice(self, l);
+    }
+    int more;
+    do {
+        more = link_fill(l);
+        if (more < 0) return -1;
+        size_t pos = 0;
+        while (!self->stop) {
+            if (self->id != 0 && l->len - pos >= sizeof(apple_hdr_t)) {
+                int passed = node_pass_empty(self, l->buf + pos);
+                if (passed < 0) return -1;
+                if (passed) {
+                    pos += sizeof(apple_hdr_t);
+                    ++l->frames;
+                    continue;
+                }
+            }
+            apple_t a;
+            ssize_t n = apple_decode(l->buf + pos, l->len - pos, &a);
+            if (n == 0) break;
+            if (n < 0) {
+                fprintf(stderr, "[Node %d] Malformed apple frame; leaving the ring.\n", self->id);
+                return -1;
             }
-            read_fd  = pipes[(i - 1 + k) % k][0];
-            write_fd = pipes[i][1];
+            pos += (size_t)n;
+            ++l->frames;
+            int rc = node_handle(self, &a);
+            if (rc < 0) return -1;
+            if (rc > 0) self->stop = 1;
+        }
+        memmove(l->buf, l->buf + pos, l->len - pos);
+        l->len -= pos;
+    } while (more && l->ch.kind == CHAN_SHM && !self->stop);
+    return 0;
+}
+
+/* With --spin, watch the shm inbound rings for a while before sleeping, so a
+ * hot handoff costs one cache-line transfer instead of an eventfd round trip.
+ * The waiting flags are lowered while spinning (the writer then skips the
+ * wakeup) and node_receive raises them again once it drains to empty. */
+static void node_spin(node_t *self) {
+    int found = 0;
+    for (int i = 0; i < self->nin; ++i) {
+        if (self->in[i].ch.kind == CHAN_SHM) atomic_store(&self->in[i].ch.ring->reader_waiting, 0);
+    }
+    for (unsigned n = 0; n < g_spin && !found; ++n) {
+        for (int i = 0; i < self->nin && !found; ++i) {
+            spsc_ring_t *r = self->in[i].ch.ring;
+            found = self->in[i].ch.kind == CHAN_SHM &&
+                    atomic_load_explicit(&r->head, memory_order_acquire) !=
+                    atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+    for (int i = 0; i < self->nin && !self->stop; ++i) {
+        if (self->in[i].ch.kind == CHAN_SHM && node_receive(self, &self->in[i]) < 0) self->stop = 1;
+    }
+}
+
+/* Frames per read and per write for this node's links; --bench adds them to
+ * the ring-wide totals */
+static void node_io_report(const node_t *self) {
+    uint64_t rc = 0, rf = 0, wc = 0, wf = 0, blocked = 0;
+    for (int i = 0; i < self->nin; ++i) {
+        rc += self->in[i].calls;
+        rf += self->in[i].frames;
+    }
+    for (int i = 0; i < self->nout; ++i) {
+        wc += self->out[i].calls;
+        wf += self->out[i].frames;
+        blocked += self->out[i].blocked_ns;
+    }
+    log_trace("[Node %d] I/O: %llu frames in %llu reads (%.2f/read), "
+              "%llu frames in %llu writes (%.2f/write), %.3f ms blocked on write\n", self->id,
+              (unsigned long long)rf, (unsigned long long)rc, rc ? (double)rf / (double)rc : 0.0,
+              (unsigned long long)wf, (unsigned long long)wc, wc ? (double)wf / (double)wc : 0.0,
+              (double)blocked / 1e6);
+    if (g_bench_io) {
+        atomic_fetch_add(&g_bench_io->rd_calls, rc);
+        atomic_fetch_add(&g_bench_io->rd_frames, rf);
+        atomic_fetch_add(&g_bench_io->wr_calls, wc);
+        atomic_fetch_add(&g_bench_io->wr_frames, wf);
+        unsigned long long prev = atomic_load(&g_bench_io->blocked_ns_max);
+        while (blocked > prev &&
+               !atomic_compare_exchange_weak(&g_bench_io->blocked_ns_max, &prev, blocked)) {}
+    }
+}
+
+/* Event loop shared by every node: wait on control, inbound links and any
+ * outbound link with bytes still queued, then service whatever is ready */
+static void respawn_children(node_t *self);
+
+static void node_loop(node_t *self) {
+    int daemon = self->id == 0 && g_listen_fd >= 0;
+    int max_fds = 2 + self->nin + self->nout + (daemon ? MAX_CLIENTS + 1 : 0);
+    struct pollfd *pfd = malloc((size_t)max_fds * sizeof(*pfd));
+    link_t **who = malloc((size_t)max_fds * sizeof(*who));
+    int *inbound = malloc((size_t)max_fds * sizeof(*inbound));
+    if (!pfd || !who || !inbound) {
+        perror("node_loop");
+        self->stop = 1;
+    }
+    self->empty_route = node_route(self, 0, 0, 0);
+    if (g_worker && !self->stop && worker_start(self) < 0) {
+        perror("worker thread");
+        self->stop = 1;
+    }
+    while (!self->stop) {
+        if (g_spin) {
+            node_spin(self);
+            if (self->stop) break;
+        }
+        /* One write per link for everything the last pass queued */
+        if (node_flush(self) < 0) break;
+        int n = 0;
+
+        pfd[n] = (struct pollfd){.fd = self->ctl_rd, .events = POLLIN};
+        who[n++] = NULL;
+        int aux = -1;
+        if (self->wd_fd >= 0) {
+            aux = n;
+            pfd[n] = (struct pollfd){.fd = self->wd_fd, .events = POLLIN};
+            who[n++] = NULL;
+        }
+        int dfirst = n;
+        if (daemon) {
+            for (int nd = daemon_pollfds(&pfd[n]); nd > 0; --nd) who[n++] = NULL;
+        }
+        int first = n;
+        for (int i = 0; i < self->nin; ++i) {
+            if (self->in[i].splice_out) chan_poll_tx(&self->out[self->in[i].splice_to].ch, &pfd[n]);
+            else chan_poll_rx(&self->in[i].ch, &pfd[n]);
+            who[n] = &self->in[i];
+            inbound[n++] = 1;
+        }
+        for (int i = 0; i < self->nout; ++i) {
+            if (self->out[i].off == self->out[i].len) continue;
+            chan_poll_tx(&self->out[i].ch, &pfd[n]);
+            who[n] = &self->out[i];
+            inbound[n++] = 0;
+        }
+
+        uint64_t slept = now_ns();
+        int polled = poll(pfd, (nfds_t)n, -1);
+        stat_add(&self->stats->idle_ns, now_ns() - slept);
+        if (polled < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (pfd[0].revents) node_control(self);
+        if (aux >= 0 && pfd[aux].revents) {
+            if (self->id == 0) watchdog_tick(self);
+            else plumb_recv(self);
+        }
+        if (first > dfirst) daemon_service(self, &pfd[dfirst], first - dfirst);
+        for (int j = first; j < n && !self->stop; ++j) {
+            if (!pfd[j].revents) continue;
+            link_t *l = who[j];
+            if (l->ch.kind == CHAN_SHM) efd_drain(pfd[j].fd);
+            int rc = inbound[j] ? node_receive(self, l) : link_flush(l);
+            if (rc < 0 && g_watchdog_ns) link_down(l);
+            else if (rc < 0) self->stop = 1;
+        }
+        if (self->reap && !self->stop) {
+            self->reap = 0;
+            respawn_children(self);
+        }
+    }
+
+    free(pfd);
+    free(who);
+    free(inbound);
+    if (self->id == 0) g_run_end_ns = now_ns();   /* the ring is done; handlers may not be */
+    worker_stop(self);
+    node_io_report(self);
+    trace_dump(self);
+}
+
+/* Thread mode: wait for the peers ring_teardown stopped and release them */
+static void ring_join_threads(pthread_t *tids) {
+    for (int i = 1; i <= g_npeers; ++i) {
+        pthread_join(tids[i], NULL);
+        node_free(&g_peers[i]);
+    }
+    g_npeers = 0;
+    free(g_peers);
+    g_peers = NULL;
+}
+
+/* --cpus: move the calling process or thread onto node id's CPU; a worker it
+ * starts later inherits the same CPU */
+static void pin_node(int id) {
+    if (!g_ncpus) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(g_cpus[id % g_ncpus], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "[Node %d] cannot pin to CPU %d: %s\n", id, g_cpus[id % g_ncpus],
+                strerror(errno));
+    }
+}
+
+/* Thread mode: body of nodes 1..k-1. Signals stay with the main thread
+ * (node 0), which relays stop and dump through our control pipe. */
+static void *node_thread(void *arg) {
+    node_t *self = arg;
+    pin_node(self->id);
+    node_loop(self);
+    log_deliver("[Node %d, pid=%d] Exiting.\n", self->id, getpid());
+    node_close_chans(self);   /* our right neighbor sees EOF, like a child exiting */
+    return NULL;
+}
+
+/* The ring's directed edges and, for each node, the edges touching it in
+ * edge order, so out[] means the same thing on every node (out[0] is always
+ * i -> i+1). --topology decides which edges exist. */
+typedef struct {
+    int  nedges;
+    int *from, *to;
+    int *adj_off;    // node i's edges are adj[adj_off[i] .. adj_off[i+1])
+    int *adj;
+    int  max_open;   // most edges node 0's process holds at once in a forked build
+} topo_t;
+
+/* When a forked build opens edge e: up front if node 0 owns an end, else just
+ * before the lower-numbered endpoint is forked */
+static int topo_opens_at(const topo_t *t, int e) {
+    int a = t->from[e], b = t->to[e];
+    return a == 0 || b == 0 ? 0 : (a < b ? a : b);
+}
+
+/* NUMA node a CPU belongs to, from sysfs; -1 if the kernel doesn't say */
+static int cpu_numa_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    int node = -1;
+    struct dirent *de;
+    while (node < 0 && (de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, "node", 4) == 0 && isdigit((unsigned char)de->d_name[4]))
+            node = atoi(de->d_name + 4);
+    }
+    closedir(d);
+    return node;
+}
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1   // <linux/mempolicy.h>; libnuma isn't needed for one call
+#endif
+
+/* --cpus on a multi-node box: before anything touches the shm rings, ask for
+ * each ring's pages on its reader's NUMA node. Only a preference, so a full
+ * node still falls back to its neighbours. */
+static void topo_place_rings(const topo_t *t, spsc_ring_t *rings) {
+    if (!g_ncpus || !rings) return;
+    int multi = 0;
+    for (int i = 0; i < g_ncpus && !multi; ++i) multi = cpu_numa_node(g_cpus[i]) > 0;
+    if (!multi) return;   /* one NUMA node: first touch already gets it right */
+
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    for (int e = 0; e < t->nedges; ++e) {
+        int node = cpu_numa_node(g_cpus[t->to[e] % g_ncpus]);
+        if (node < 0 || node >= (int)(8 * sizeof(unsigned long))) continue;
+        unsigned long mask = 1ul << node;
+        uintptr_t lo = (uintptr_t)&rings[e] & ~(page - 1);
+        uintptr_t hi = ((uintptr_t)&rings[e + 1] + page - 1) & ~(page - 1);
+        if (syscall(SYS_mbind, (void *)lo, hi - lo, MPOL_PREFERRED, &mask,
+                    8 * sizeof(mask), 0) < 0) {
+            fprintf(stderr, "[Node 0] mbind: %s; shm rings stay where first touched.\n",
+                    strerror(errno));
+            return;
+        }
+    }
+}
+
+static void topo_free(topo_t *t) {
+    free(t->from);
+    free(t->to);
+    free(t->adj_off);
+    free(t->adj);
+    memset(t, 0, sizeof(*t));
+}
+
+static int topo_build(topo_t *t, int k) {
+    memset(t, 0, sizeof(*t));
+    int levels = 1;   /* finger j links i -> i+2^j for every 2^j < k */
+    if (g_topology == TOPO_FINGER) while ((1 << levels) < k) ++levels;
+    int n = g_topology == TOPO_BI ? 2 * k : levels * k;
+    t->from    = malloc((size_t)n * sizeof(int));
+    t->to      = malloc((size_t)n * sizeof(int));
+    t->adj_off = calloc((size_t)k + 2, sizeof(int));
+    t->adj     = malloc((size_t)n * 2 * sizeof(int));
+    int *held  = calloc((size_t)k + 2, sizeof(int));
+    if (!t->from || !t->to || !t->adj_off || !t->adj || !held) {
+        free(held);
+        topo_free(t);
+        return -1;
+    }
+    for (int j = 0; j < levels; ++j) {
+        for (int i = 0; i < k; ++i) {
+            t->from[t->nedges] = i;
+            t->to[t->nedges++] = (i + (1 << j)) % k;
+        }
+    }
+    if (g_topology == TOPO_BI) {
+        for (int i = 0; i < k; ++i) {
+            t->from[t->nedges] = i;
+            t->to[t->nedges++] = (i - 1 + k) % k;
+        }
+    }
+
+    /* Adjacency in edge order, counting-sort style */
+    for (int e = 0; e < t->nedges; ++e) {
+        ++t->adj_off[t->from[e] + 2];
+        ++t->adj_off[t->to[e] + 2];
+    }
+    for (int i = 2; i <= k + 1; ++i) t->adj_off[i] += t->adj_off[i - 1];
+    for (int e = 0; e < t->nedges; ++e) {
+        t->adj[t->adj_off[t->from[e] + 1]++] = e;
+        t->adj[t->adj_off[t->to[e] + 1]++] = e;
+    }
+
+    /* Node 0 holds an edge from its opening until both ends' owners exist */
+    for (int e = 0; e < t->nedges; ++e) {
+        int a = t->from[e], b = t->to[e];
+        int last = a == 0 || b == 0 ? k : (a > b ? a : b);
+        ++held[topo_opens_at(t, e)];
+        --held[last + 1];
+    }
+    for (int i = 0, open = 0; i <= k; ++i) {
+        open += held[i];
+        if (open > t->max_open) t->max_open = open;
+    }
+    free(held);
+    return 0;
+}
+
+/* Hook node n up to its ends of the ring's edges */
+static int node_attach(node_t *n, const topo_t *t, edge_t *edges) {
+    for (int j = t->adj_off[n->id]; j < t->adj_off[n->id + 1]; ++j) {
+        int e = t->adj[j];
+        if (t->from[e] == n->id && node_add_out(n, edges[e].wr) < 0) return -1;
+        if (t->to[e] == n->id && node_add_in(n, edges[e].rd) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Thread mode: start nodes 1..k-1 on their edges with every signal blocked */
+static int spawn_threads(const topo_t *t, edge_t *edges, int k, pthread_t *tids) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = 0;
+    for (int i = 1; i < k && rc == 0; ++i) {
+        if (node_init(&g_peers[i], i) < 0 || node_attach(&g_peers[i], t, edges) < 0) {
+            perror("node_init");
+            rc = -1;
+            break;
+        }
+        g_npeers = i;
+        int err = pthread_create(&tids[i], NULL, node_thread, &g_peers[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            node_free(&g_peers[i]);
+            g_npeers = i - 1;
+            rc = -1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return rc;
+}
+
+/* Make sure the descriptor limit allows what node 0's process will hold
+ * (raising the soft limit if we may) before anything is built, rather than
+ * failing halfway round the ring. Forked rings only hold a few edges at once;
+ * thread rings hold all of them. */
+static int ring_fd_check(const topo_t *t, int k) {
+    unsigned long long per_edge = g_transport == CHAN_SHM ? 4 : 2;
+    unsigned long long need = 16;   // stdio, input/output files, node 0's control pipe
+    if (g_threads) {
+        /* every edge plus a control pipe per node */
+        need += per_edge * (unsigned long long)t->nedges + 2ull * (unsigned long long)k;
+    } else {
+        need += per_edge * (unsigned long long)t->max_open;
+        if (g_watchdog_ns) need += (unsigned long long)k;   // a socket per child
+    }
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= need) {
+        return 0;
+    }
+    if (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= need) {
+        rl.rlim_cur = need;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == 0) return 0;
+    }
+    fprintf(stderr, "A %d-node ring needs about %llu file descriptors but RLIMIT_NOFILE allows %llu;\n"
+            "raise it with ulimit -n.\n", k, need, (unsigned long long)rl.rlim_max);
+    return -1;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Child: close every inherited descriptor above stdio except keep[], with a
+ * close_range per gap instead of a close() per edge of the ring */
+static void close_fds_except(int *keep, int n) {
+    qsort(keep, (size_t)n, sizeof(keep[0]), cmp_int);
+    unsigned lo = 3;
+    for (int i = 0; i < n; ++i) {
+        if (keep[i] < (int)lo) continue;
+        if ((unsigned)keep[i] > lo) close_range(lo, (unsigned)keep[i] - 1, 0);
+        lo = (unsigned)keep[i] + 1;
+    }
+    close_range(lo, ~0U, 0);
+}
+
+/* Child: become node i on our ends of its edges (plus the socket node 0
+ * sends replacement pipe ends down under --watchdog), and never return */
+static void node_child(const topo_t *t, edge_t *edges, int i, int plumb) {
+    const int *mine = &t->adj[t->adj_off[i]];
+    int deg = t->adj_off[i + 1] - t->adj_off[i];
+    g_parent = 0;
+    /* Own process group, so node 0 can stop the ring with one kill() */
+    if (g_ring_pgid <= 0 || setpgid(0, g_ring_pgid) < 0) setpgid(0, 0);
+    pin_node(i);
+    signal(SIGINT, SIG_DFL);   /* only node 0 handles Ctrl-C */
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);  /* a vanished neighbor shows up as EPIPE */
+    signal(SIGCHLD, SIG_DFL);
+
+    /* Close everything but our own ends of our own edges */
+    int keep[4 * 2 * MAX_LINKS + 1], nkeep = 0;
+    for (int j = 0; j < deg; ++j) {
+        const edge_t *e = &edges[mine[j]];
+        const chan_t *c = t->from[mine[j]] == i ? &e->wr : &e->rd;
+        if (g_transport == CHAN_PIPE) {
+            keep[nkeep++] = c->fd;
+        } else {
+            keep[nkeep++] = c->data_efd;
+            keep[nkeep++] = c->space_efd;
+        }
+    }
+    if (plumb >= 0) keep[nkeep++] = plumb;
+    close_fds_except(keep, nkeep);
+    node_t self;
+    if (node_init(&self, i) < 0 || node_attach(&self, t, edges) < 0) {
+        perror("node_init");
+        _exit(1);
+    }
+    self.wd_fd = plumb;
+    g_self = &self;
+    install_handler(SIGUSR1, sigusr1_handler);
+    install_handler(SIGUSR2, sigusr2_handler);
+
+    /* Run node loop */
+    node_loop(&self);
+
+    /* Graceful exit */
+    log_deliver("[Node %d, pid=%d] Exiting.\n", i, getpid());
+    g_self = NULL;
+    node_free(&self);
+    _exit(0);
+}
+
+/* --watchdog: the ring node 0 is running, for respawning nodes into */
+static const topo_t *g_topo = NULL;
+static edge_t       *g_edges = NULL;
+
+/* Position of edge e among node n's outbound (or inbound) links; node_attach
+ * adds them in adjacency order */
+static int topo_link_index(const topo_t *t, int n, int e, int out) {
+    int idx = 0;
+    for (int j = t->adj_off[n]; j < t->adj_off[n + 1] && t->adj[j] != e; ++j) {
+        idx += out ? t->from[t->adj[j]] == n : t->to[t->adj[j]] == n;
+    }
+    return idx;
+}
+
+/* Hand child over sock a pipe end for its link {out, index} */
+static int plumb_send(int sock, int out, int index, int fd) {
+    int32_t m[2] = {out, index};
+    struct iovec iov = {.iov_base = m, .iov_len = sizeof(m)};
+    union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } u;
+    memset(&u, 0, sizeof(u));
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = u.buf, .msg_controllen = sizeof(u.buf)};
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type  = SCM_RIGHTS;
+    c->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(fd));
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/* Fork a fresh node i on new pipes for all of its edges. Node 0 swaps its
+ * own ends in directly; other neighbours get theirs over their socket. */
+static int respawn_node(node_t *self, int i) {
+    const topo_t *t = g_topo;
+    const int *mine = &t->adj[t->adj_off[i]];
+    int deg = t->adj_off[i + 1] - t->adj_off[i];
+    int sp[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sp) < 0) return -1;
+    int opened = 0;
+    while (opened < deg && edge_open(&g_edges[mine[opened]], NULL) == 0) ++opened;
+    /* Node 0's worker may be printing: fork between its writes, not halfway
+     * through one. The child starts with its stdio locks reset by fork. */
+    fflush(stdout);
+    flockfile(stdout);
+    pid_t pid = opened == deg ? fork() : -1;
+    if (pid != 0) funlockfile(stdout);
+    if (pid < 0) {
+        for (int j = 0; j < opened; ++j) {
+            chan_forget(&g_edges[mine[j]].rd);
+            chan_forget(&g_edges[mine[j]].wr);
+        }
+        close(sp[0]);
+        close(sp[1]);
+        return -1;
+    }
+    if (pid == 0) node_child(t, g_edges, i, sp[1]);
+
+    ring_group_add(pid);
+    child_pids[i - 1] = pid;
+    close(sp[1]);
+    if (g_plumb[i] >= 0) close(g_plumb[i]);
+    g_plumb[i] = sp[0];
+    for (int j = 0; j < deg; ++j) {
+        int e = mine[j];
+        int out = t->from[e] == i;               // i writes this edge, the far node reads it
+        int far = out ? t->to[e] : t->from[e];
+        chan_t *c = out ? &g_edges[e].rd : &g_edges[e].wr;
+        chan_forget(out ? &g_edges[e].wr : &g_edges[e].rd);
+        int idx = topo_link_index(t, far, e, !out);
+        if (far == 0) {
+            link_replace(out ? &self->in[idx] : &self->out[idx], c->fd);
+            c->fd = -1;
+            continue;
+        }
+        if (plumb_send(g_plumb[far], !out, idx, c->fd) < 0) {
+            fprintf(stderr, "[Node 0] cannot relink node %d: %s\n", far, strerror(errno));
+        }
+        chan_forget(c);
+    }
+    return 0;
+}
+
+/* Node 0, after SIGCHLD: reap, respawn each dead node and send every live
+ * token round again, since the dead node took whatever it was holding */
+static void respawn_children(node_t *self) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        int i = 1;
+        while (i < g_k && child_pids[i - 1] != pid) ++i;
+        if (i == g_k) continue;
+        watchdog_fault();
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "[Node 0] Node %d (pid %d) was killed by signal %d; respawning it.\n",
+                    i, pid, WTERMSIG(status));
+        } else {
+            fprintf(stderr, "[Node 0] Node %d (pid %d) exited with status %d; respawning it.\n",
+                    i, pid, WEXITSTATUS(status));
+        }
+        uint64_t started = now_ns();
+        if (respawn_node(self, i) < 0) {
+            perror("respawn");
+            self->stop = 1;
+            return;
+        }
+        uint64_t ns = now_ns() - started;
+        ++g_wd.respawns;
+        if (ns > g_wd.respawn_ns_max) g_wd.respawn_ns_max = ns;
+        fprintf(stderr, "[Node 0] Node %d is back as pid %d after %.1f us.\n",
+                i, child_pids[i - 1], (double)ns / 1e3);
+        for (int t = 0; t < g_tokens; ++t) {
+            if (g_token_sent[t]) watchdog_reissue(self, t);
+        }
+    }
+}
+
+/* Release what run_ring allocated for one ring */
+static void ring_release(topo_t *t, edge_t *edges, pthread_t *tids, spsc_ring_t *rings,
+                         size_t rings_len) {
+    topo_free(t);
+    free(edges);
+    free(tids);
+    free(child_pids);
+    child_pids = NULL;
+    if (rings) munmap(rings, rings_len);
+    if (g_stats) munmap(g_stats, (size_t)g_k * sizeof(*g_stats));
+    g_stats = NULL;
+    for (int i = 0; g_plumb && i < g_k; ++i) {
+        if (g_plumb[i] >= 0) close(g_plumb[i]);
+    }
+    free(g_plumb);
+    g_plumb = NULL;
+    g_topo = NULL;
+    g_edges = NULL;
+}
+
+/* --hosts: "id host:port" per line ('#' comments); every id 0..k-1 exactly
+ * once. Returns k, or -1 with the problem reported. */
+static int hosts_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    host_t *hosts = NULL;   // grown to cover the highest id seen, then cut to k
+    int k = 0, cap = 0, line_no = 0, bad = 0;
+    char line[512];
+    while (!bad && fgets(line, sizeof(line), f)) {
+        ++line_no;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+        int id;
+        char addr[300];
+        char *colon = NULL;
+        if (sscanf(p, "%d %299s", &id, addr) != 2 || id < 0 || id >= MAX_K ||
+            !(colon = strrchr(addr, ':')) || colon == addr || !colon[1] ||
+            colon - addr >= (long)sizeof(hosts[0].host) || strlen(colon + 1) >= sizeof(hosts[0].port)) {
+            fprintf(stderr, "%s line %d: expected \"id host:port\".\n", path, line_no);
+            bad = 1;
+            break;
+        }
+        if (id >= cap) {
+            int grow = cap ? 2 * cap : 8;
+            if (grow <= id) grow = id + 1;
+            host_t *grown = realloc(hosts, (size_t)grow * sizeof(*grown));
+            if (!grown) {
+                perror(path);
+                bad = 1;
+                break;
+            }
+            memset(&grown[cap], 0, (size_t)(grow - cap) * sizeof(*grown));
+            hosts = grown;
+            cap = grow;
+        }
+        if (hosts[id].host[0]) {
+            fprintf(stderr, "%s line %d: node %d is listed twice.\n", path, line_no, id);
+            bad = 1;
+            break;
+        }
+        *colon = '\0';
+        strcpy(hosts[id].host, addr);
+        strcpy(hosts[id].port, colon + 1);
+        if (id >= k) k = id + 1;
+    }
+    fclose(f);
+    for (int i = 0; !bad && i < k; ++i) {
+        if (hosts[i].host[0]) continue;
+        fprintf(stderr, "%s: no address for node %d.\n", path, i);
+        bad = 1;
+    }
+    if (!bad && k < 2) {
+        fprintf(stderr, "%s: a ring needs at least 2 nodes.\n", path);
+        bad = 1;
+    }
+    if (bad) {
+        free(hosts);
+        return -1;
+    }
+    if (cap > k) {
+        host_t *fit = realloc(hosts, (size_t)k * sizeof(*fit));
+        if (fit) hosts = fit;
+    }
+    free(g_hosts);
+    g_hosts = hosts;
+    return k;
+}
+
+/* First thing on a new edge, from the connecting (writing) side */
+#define TCP_MAGIC 0x4f424131u   // "OBA1"; also catches a peer of the other byte order
+typedef struct {
+    uint32_t magic;
+    int32_t  k, edge, from;
+} tcp_hello_t;
+
+/* Wait until fd is ready (POLLIN for an accept, a hello or the retry timer,
+ * POLLOUT for a connect or a hello going out) or the deadline passes */
+static int tcp_wait(int fd, short events, uint64_t deadline) {
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= deadline || g_interrupted) return -1;
+        struct pollfd p = {.fd = fd, .events = events};
+        int r = poll(&p, 1, (int)((deadline - now) / 1000000u) + 1);
+        if (r > 0) return 0;
+        if (r < 0 && errno != EINTR) return -1;
+    }
+}
+
+/* Send (out) or receive a whole hello on a non-blocking socket; a stream
+ * may hand it over in pieces. -1 if the peer hangs up or time runs out. */
+static int tcp_xfer(int fd, void *buf, size_t n, int out, uint64_t deadline) {
+    char *p = buf;
+    size_t off = 0;
+    while (off < n) {
+        ssize_t r = out ? write(fd, p + off, n - off) : read(fd, p + off, n - off);
+        if (r > 0) {
+            off += (size_t)r;
+            continue;
+        }
+        if (r == 0 || (errno != EAGAIN && errno != EINTR)) return -1;
+        if (tcp_wait(fd, out ? POLLOUT : POLLIN, deadline) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Connect to node id, retrying while it isn't listening yet. Connects are
+ * non-blocking and waited on in poll(); the pause before a retry is a
+ * timerfd, so nothing sleeps or spins. */
+#define TCP_RETRY_MS 50
+static int tcp_connect(int id, uint64_t deadline) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *ai = NULL;
+    int err = getaddrinfo(g_hosts[id].host, g_hosts[id].port, &hints, &ai);
+    if (err) {
+        fprintf(stderr, "[Node %d] %s: %s\n", g_node_id, g_hosts[id].host, gai_strerror(err));
+        return -1;
+    }
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd < 0) {
+        perror("timerfd_create");
+        freeaddrinfo(ai);
+        return -1;
+    }
+    int fd = -1;
+    while (fd < 0 && !g_interrupted) {
+        for (struct addrinfo *a = ai; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                        a->ai_protocol);
+            if (fd < 0) continue;
+            int soerr = 0;
+            socklen_t sl = sizeof(soerr);
+            if (connect(fd, a->ai_addr, a->ai_addrlen) < 0 &&
+                (errno != EINPROGRESS || tcp_wait(fd, POLLOUT, deadline) < 0 ||
+                 getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &sl) < 0 || soerr)) {
+                /* refused (not listening yet), unreachable, or out of time */
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (fd >= 0 || now_ns() >= deadline) break;
+        struct itimerspec its = {.it_value = {.tv_nsec = TCP_RETRY_MS * 1000000L}};
+        uint64_t expirations;
+        if (timerfd_settime(tfd, 0, &its, NULL) < 0 || tcp_wait(tfd, POLLIN, deadline) < 0 ||
+            read(tfd, &expirations, sizeof(expirations)) < 0) break;
+    }
+    close(tfd);
+    freeaddrinfo(ai);
+    if (fd < 0 && !g_interrupted) {
+        fprintf(stderr, "[Node %d] node %d at %s:%s did not come up within %d ms.\n",
+                g_node_id, id, g_hosts[id].host, g_hosts[id].port, TCP_CONNECT_MS);
+    }
+    return fd;
+}
+
+/* Non-blocking, no Nagle delay: a frame is written whole once per loop pass,
+ * so holding small writes back would only add latency */
+static void tcp_tune(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* -T tcp: connect our outbound edges to the nodes they lead to, then accept
+ * our inbound ones; each edge is one connection, named by its hello. Only
+ * this node's ends in edges[] are filled in. */
+static int tcp_ring_open(const topo_t *t, edge_t *edges, int me) {
+    int lfd = -1;
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM,
+                             .ai_flags = AI_PASSIVE}, *ai = NULL;
+    int err = getaddrinfo(NULL, g_hosts[me].port, &hints, &ai);
+    if (err) {
+        fprintf(stderr, "[Node %d] port %s: %s\n", me, g_hosts[me].port, gai_strerror(err));
+        return -1;
+    }
+    int one = 1;
+    for (struct addrinfo *a = ai; a && lfd < 0; a = a->ai_next) {
+        lfd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (lfd < 0) continue;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(lfd, a->ai_addr, a->ai_addrlen) < 0 || listen(lfd, SOMAXCONN) < 0) {
+            close(lfd);
+            lfd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    if (lfd < 0) {
+        fprintf(stderr, "[Node %d] cannot listen on port %s: %s\n", me, g_hosts[me].port,
+                strerror(errno));
+        return -1;
+    }
+    for (int e = 0; e < t->nedges; ++e) {
+        edges[e].rd = edges[e].wr = (chan_t){.kind = CHAN_TCP, .fd = -1, .data_efd = -1,
+                                             .space_efd = -1};
+    }
+
+    /* Our neighbours' listeners take the connection even before they accept,
+     * so connecting first can't deadlock however the nodes were started */
+    uint64_t deadline = now_ns() + TCP_CONNECT_MS * 1000000ull;
+    int rc = 0, nin = 0;
+    for (int j = t->adj_off[me]; j < t->adj_off[me + 1] && rc == 0; ++j) {
+        int e = t->adj[j];
+        if (t->from[e] != me) {
+            ++nin;
+            continue;
+        }
+        int fd = tcp_connect(t->to[e], deadline);
+        tcp_hello_t h = {.magic = TCP_MAGIC, .k = g_k, .edge = e, .from = me};
+        if (fd < 0 || tcp_xfer(fd, &h, sizeof(h), 1, deadline) < 0) {
+            if (fd >= 0) close(fd);
+            rc = -1;
+            break;
+        }
+        tcp_tune(fd);
+        edges[e].wr.fd = fd;
+    }
+    while (rc == 0 && nin > 0) {
+        if (tcp_wait(lfd, POLLIN, deadline) < 0) {
+            if (!g_interrupted)
+                fprintf(stderr, "[Node %d] %d inbound neighbour(s) never connected.\n", me, nin);
+            rc = -1;
+            break;
+        }
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (fd < 0) continue;
+        tcp_hello_t h;
+        if (tcp_xfer(fd, &h, sizeof(h), 0, deadline) < 0 ||
+            h.magic != TCP_MAGIC || h.k != g_k || h.edge < 0 || h.edge >= t->nedges ||
+            t->to[h.edge] != me || t->from[h.edge] != h.from || edges[h.edge].rd.fd >= 0) {
+            /* a stray connection, or a node started with a different ring */
+            fprintf(stderr, "[Node %d] Rejected a connection that isn't one of our edges "
+                    "(same --hosts and --topology everywhere?).\n", me);
+            close(fd);
+            continue;
+        }
+        tcp_tune(fd);
+        edges[h.edge].rd.fd = fd;
+        --nin;
+    }
+    close(lfd);
+    if (rc < 0) {
+        for (int e = 0; e < t->nedges; ++e) {
+            chan_forget(&edges[e].rd);
+            chan_forget(&edges[e].wr);
+        }
+    }
+    return rc;
+}
+
+/* Build a k-node ring, run node 0 until its input is done, then tear it down */
+static int run_ring(int k) {
+    g_k = k;
+    g_tokens_live = 0;
+    g_inflight = 0;
+    memset(g_lap_bytes, 0, sizeof(g_lap_bytes));
+    memset(g_token_sent, 0, sizeof(g_token_sent));
+    memset(&g_wd, 0, sizeof(g_wd));
+    g_fault_ns = 0;
+    g_empty_left = 0;
+    g_empty_laps = 0;
+    g_empty_ns = 0;
+    g_lookahead = g_batch || g_listen_fd >= 0 || (g_bench_n && g_urgent_pct);
+    g_lz_raw = 0;
+    g_lz_wire = 0;
+    queue_reset();
+
+    uint64_t setup_start = now_ns();
+    /* Ctrl-C from here on stops the ring; children go back to the default */
+    install_handler(SIGINT, sigint_parent_handler);
+    install_handler(SIGTERM, sigint_parent_handler);
+    pin_node(0);   /* children and threads start here, then move to their own CPU */
+    topo_t topo;
+    if (topo_build(&topo, k) != 0) {
+        perror("topology");
+        return 1;
+    }
+    if (ring_fd_check(&topo, k) != 0) {
+        topo_free(&topo);
+        return 1;
+    }
+    g_stats = mmap(NULL, (size_t)k * sizeof(*g_stats), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_stats == MAP_FAILED) {
+        perror("mmap(stats)");
+        g_stats = NULL;
+        topo_free(&topo);
+        return 1;
+    }
+
+    /* Shared rings must exist before fork so every node maps the same pages */
+    spsc_ring_t *rings = NULL;
+    size_t rings_len = (size_t)topo.nedges * sizeof(spsc_ring_t);
+    if (g_transport == CHAN_SHM) {
+        rings = mmap(NULL, rings_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (rings == MAP_FAILED) {
+            perror("mmap");
+            ring_release(&topo, NULL, NULL, NULL, 0);
+            return 1;
+        }
+        topo_place_rings(&topo, rings);
+    }
 
-            /* Run node loop */
-            node_loop();
-            /* never returns */
-        } else {
-            /* Parent: remember child pid */
-            child_pids[num_children++] = pid;
+    /* Per-ring tables, sized to k */
+    edge_t *edges = calloc((size_t)topo.nedges, sizeof(*edges));
+    pthread_t *tids = g_threads ? calloc((size_t)k, sizeof(*tids)) : NULL;
+    if (g_threads) g_peers = calloc((size_t)k, sizeof(*g_peers));
+    else child_pids = calloc((size_t)k, sizeof(*child_pids));
+    if (g_watchdog_ns) {
+        g_plumb = malloc((size_t)k * sizeof(*g_plumb));
+        for (int i = 0; g_plumb && i < k; ++i) g_plumb[i] = -1;
+    }
+    if (!edges || (g_threads ? !tids || !g_peers : !child_pids) || (g_watchdog_ns && !g_plumb)) {
+        perror("calloc");
+        free(g_peers);
+        g_peers = NULL;
+        ring_release(&topo, edges, tids, rings, rings_len);
+        return 1;
+    }
+
+    /* Threads need every edge now; a forked ring starts with node 0's and
+     * opens the rest as it goes */
+    if (g_transport == CHAN_TCP && tcp_ring_open(&topo, edges, g_node_id) < 0) {
+        ring_release(&topo, edges, tids, rings, rings_len);
+        return 1;
+    }
+    for (int e = 0; e < topo.nedges && g_transport != CHAN_TCP; ++e) {
+        if (!g_threads && topo_opens_at(&topo, e) != 0) continue;
+        if (edge_open(&edges[e], rings ? &rings[e] : NULL) < 0) {
+            perror(g_transport == CHAN_SHM ? "eventfd" : "pipe");
+            ring_release(&topo, edges, tids, rings, rings_len);
+            return 1;
         }
     }
 
-    /* Parent (node 0) sets up its own fds */
-    my_id   = 0;
-    read_fd = pipes[(0 - 1 + k) % k][0];  /* read from k-1 */
-    write_fd= pipes[0][1];                /* write to 0 -> 1 */
+    /* Nothing buffered may be duplicated into the children */
+    fflush(stdout);
 
-    /* Close all other unused fds in parent */
-    for (int j = 0; j < k; ++j) {
-        if (j != (k - 1)) close(pipes[j][0]);
-        if (j != 0)       close(pipes[j][1]);
+    if (g_threads && spawn_threads(&topo, edges, k, tids) != 0) {
+        ring_teardown();   /* stop whatever did start */
+        ring_join_threads(tids);
+        ring_release(&topo, edges, tids, rings, rings_len);
+        return 1;
     }
 
-    /* Install Ctrl-C handler in parent */
-    struct sigaction sa = {0};
-    sa.sa_handler = sigint_parent_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGINT, &sa, NULL);
+    /* Fork k-1 children (node ids 1..k-1). Parent is node 0. An edge is
+     * opened just before its lower endpoint is forked, and node 0 drops each
+     * end as soon as its owner exists, so only a few edges are open here and
+     * each child inherits O(degree) descriptors: setup is linear in k. */
+    for (int i = 1; i < k && !g_threads && g_transport != CHAN_TCP; ++i) {
+        const int *mine = &topo.adj[topo.adj_off[i]];
+        int deg = topo.adj_off[i + 1] - topo.adj_off[i];
+        for (int j = 0; j < deg; ++j) {
+            if (topo_opens_at(&topo, mine[j]) != i) continue;   /* already open */
+            if (edge_open(&edges[mine[j]], rings ? &rings[mine[j]] : NULL) < 0) {
+                perror(g_transport == CHAN_SHM ? "eventfd" : "pipe");
+                ring_teardown();
+                ring_release(&topo, edges, tids, rings, rings_len);
+                return 1;
+            }
+        }
+        int sp[2] = {-1, -1};
+        if (g_watchdog_ns && socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sp) < 0) {
+            perror("socketpair");
+            ring_teardown();
+            ring_release(&topo, edges, tids, rings, rings_len);
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            if (sp[0] >= 0) {
+                close(sp[0]);
+                close(sp[1]);
+            }
+            ring_teardown();   /* stop the children that did start */
+            ring_release(&topo, edges, tids, rings, rings_len);
+            return 1;
+        } else if (pid == 0) {
+            node_child(&topo, edges, i, sp[1]);
+        } else {
+            /* Parent: remember child pid; node i now owns the ends it was lent */
+            ring_group_add(pid);
+            child_pids[num_children++] = pid;
+            if (g_plumb) {
+                close(sp[1]);
+                g_plumb[i] = sp[0];
+            }
+            for (int j = 0; j < deg; ++j) {
+                edge_t *e = &edges[mine[j]];
+                chan_forget(topo.from[mine[j]] == i ? &e->wr : &e->rd);
+            }
+        }
+    }
+
+    /* Parent (node 0) sets up its own ends */
+    node_t self;
+    /* read from k-1, write to 0 -> 1 (plus the extra edges of other topologies) */
+    if (node_init(&self, g_node_id) < 0 || node_attach(&self, &topo, edges) < 0) {
+        perror("node_init");
+        ring_teardown();
+        ring_join_threads(tids);
+        ring_release(&topo, edges, tids, rings, rings_len);
+        return 1;
+    }
+    g_self = &self;
+    if (g_interrupted) self.stop = 1;   /* Ctrl-C while the ring was being built */
+    signal(SIGPIPE, SIG_IGN);
+    if (self.id != 0) {
+        /* -T tcp, any node but 0: node 0's input drives the ring from its
+         * host; we leave when a neighbour's connection closes, or on Ctrl-C */
+        install_handler(SIGUSR1, sigusr1_handler);
+        install_handler(SIGUSR2, sigusr2_handler);
+        log_deliver("[Node %d, pid=%d] Joined the %d-node ring.\n", self.id, getpid(), k);
+        node_loop(&self);
+        log_deliver("[Node %d, pid=%d] Exiting.\n", self.id, getpid());
+        if (g_stats_at_exit) stats_dump();
+        g_self = NULL;
+        node_free(&self);
+        ring_release(&topo, edges, tids, rings, rings_len);
+        queue_reset();
+        return 0;
+    }
+    if (g_watchdog_ns) {
+        /* Check laps a few times per timeout; the children that have died
+         * already are reaped by the poke below */
+        uint64_t every = g_watchdog_ns / 4;
+        struct itimerspec its = {
+            .it_interval = {.tv_sec = (time_t)(every / 1000000000u), .tv_nsec = (long)(every % 1000000000u)},
+        };
+        its.it_value = its.it_interval;
+        self.wd_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (self.wd_fd < 0 || timerfd_settime(self.wd_fd, 0, &its, NULL) < 0) {
+            perror("timerfd");
+            ring_teardown();
+            node_free(&self);
+            ring_release(&topo, edges, tids, rings, rings_len);
+            return 1;
+        }
+        g_topo = &topo;
+        g_edges = edges;
+        install_handler(SIGCHLD, sigchld_handler);
+        node_poke(&self, 'c');
+    }
 
     /* Also handle SIGUSR1 in parent (e.g., if someone signals us) */
-    signal(SIGUSR1, sigusr1_handler);
+    install_handler(SIGUSR1, sigusr1_handler);
+    install_handler(SIGUSR2, sigusr2_handler);
 
-    printf("[Node 0, pid=%d] Ring created with k=%d nodes.\n", getpid(), k);
-    printf("[Node 0] Instructions: When prompted, enter a destination [0..%d] and a message.\n", k-1);
-    printf("          Press Ctrl-C (or enter 'q' at destination prompt) to exit.\n");
+    log_deliver("[Node 0, pid=%d] Ring created with k=%d nodes.\n", getpid(), k);
+    if (g_batch || g_bench_n) {
+        log_deliver("[Node 0] Batch mode: injecting records as the apple returns.\n");
+    } else if (g_listen_fd >= 0) {
+        log_deliver("[Node 0] Listening on %s for \"dest<TAB>text\" records; "
+                    "Ctrl-C or SIGTERM stops the ring.\n", g_listen_path);
+    } else {
+        printf("[Node 0] Instructions: When prompted, enter a destination [0..%d] and a message.\n", k-1);
+        printf("          Press Ctrl-C (or enter 'q' at destination prompt) to exit.\n");
+    }
+
+    g_setup_ns = now_ns() - setup_start;
 
-    /* Seed the ring with an empty apple to start the cycle */
-    // zk I haven't seen this syntax before.
-    apple_t seed = {.dest = DEST_EMPTY, .origin = 0};
-    seed.text[0] = '\0';
-    if (write_full(write_fd, &seed, sizeof(seed)) < 0) {
-        perror("write(seed)");
-        /* try to shutdown */
-        // zk What's the difference between raise and kill? 
-        raise(SIGINT);
+    /* Seed the ring with empty apples (one per token) to start the cycle */
+    g_run_start_ns = now_ns();
+    if (g_bench_n) {
+        g_empty_left = BENCH_EMPTY_HOPS / k;
+        if (g_empty_left < g_tokens) g_empty_left = g_tokens;
+    }
+    for (int t = 0; t < g_tokens; ++t) {
+        // zk I haven't seen this syntax before.
+        apple_t seed = {.id = t, .used = 0};
+        g_token_id[t] = (uint32_t)t;
+        g_token_sent[t] = now_ns();
+        if (link_send(&self.out[0], &seed) < 0) {
+            perror("write(seed)");
+            /* try to shutdown */
+            // zk What's the difference between raise and kill? 
+            raise(SIGINT);
+        }
+        ++g_tokens_live;
     }
 
     /* Enter node loop as node 0 */
-    node_loop();
+    node_loop(&self);
+
+    if (g_watchdog_ns) {
+        signal(SIGCHLD, SIG_DFL);   /* ring_teardown's wait() reaps from here on */
+        if (g_wd.faults) {
+            fprintf(stderr, "[Node 0] Watchdog: %u fault(s), %u respawn(s) (slowest %.1f us), "
+                    "%u apple(s) reissued, %u late apple(s) dropped; recovered %u time(s), "
+                    "avg %.3f ms, max %.3f ms.\n", g_wd.faults, g_wd.respawns,
+                    (double)g_wd.respawn_ns_max / 1e3, g_wd.reissued, g_wd.stale, g_wd.recovered,
+                    g_wd.recovered ? (double)g_wd.recover_ns_sum / g_wd.recovered / 1e6 : 0.0,
+                    (double)g_wd.recover_ns_max / 1e6);
+        }
+    }
+    if (g_interrupted) {
+        fprintf(stderr, "\n[Node 0] Caught %s: initiating graceful shutdown...\n",
+                g_interrupted == SIGTERM ? "SIGTERM" : "Ctrl-C");
+    }
+    uint64_t teardown_start = now_ns();
+    ring_teardown();
+    ring_join_threads(tids);
+    g_teardown_ns = now_ns() - teardown_start;
+    log_deliver("[Node 0] Ring torn down in %.3f ms.\n", (double)g_teardown_ns / 1e6);
+    if (g_stats_at_exit) stats_dump();
+    g_self = NULL;
+    node_free(&self);
+    ring_release(&topo, edges, tids, rings, rings_len);
+    queue_reset();
+    return 0;
+}
+
+/* Parse "a,b,c" into out[]; each entry must lie in [lo, hi] */
+static int parse_list(const char *s, int lo, int hi, int *out, int max) {
+    int n = 0;
+    const char *p = s;
+    while (*p) {
+        char *end = NULL;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < lo || v > hi || n == max) return -1;
+        out[n++] = (int)v;
+        if (*end == ',') ++end;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return n;
+}
+
+/* --cpus "0-3,8,10-11": CPUs in the order nodes take them. Each must be one
+ * this process may run on. Returns the count, or -1. */
+static int parse_cpus(const char *s, int **out) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return -1;
+    int n = 0, cap = 0, ok = 1, *cpus = NULL;
+    const char *p = s;
+    while (ok && *p) {
+        char *end = NULL;
+        long a = strtol(p, &end, 10), b = a;
+        ok = end != p && a >= 0 && a < CPU_SETSIZE;
+        if (ok && *end == '-') {
+            p = end + 1;
+            b = strtol(p, &end, 10);
+            ok = end != p && b >= a && b < CPU_SETSIZE;
+        }
+        for (long c = a; ok && c <= b; ++c) {
+            if (!CPU_ISSET((int)c, &allowed)) {
+                fprintf(stderr, "CPU %ld is offline or outside this process's affinity mask.\n", c);
+                ok = 0;
+                break;
+            }
+            if (n == cap) {
+                cap = cap ? 2 * cap : 16;
+                int *grown = realloc(cpus, (size_t)cap * sizeof(*grown));
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                cpus = grown;
+            }
+            cpus[n++] = (int)c;
+        }
+        if (ok && *end == ',') ++end;
+        else if (ok && *end != '\0') ok = 0;
+        p = end;
+    }
+    if (!ok || n == 0) {
+        free(cpus);
+        return -1;
+    }
+    *out = cpus;
+    return n;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* p99 delivery latency of the bench messages sent in class c (0 if none);
+ * buf has room for every message */
+static uint64_t bench_class_p99(uint64_t *buf, int c) {
+    int n = 0;
+    for (int i = 0; i < g_bench_n; ++i) {
+        if (g_bench_recs[i].hops && g_bench_recs[i].prio == (uint32_t)c)
+            buf[n++] = g_bench_recs[i].lat_ns;
+    }
+    if (!n) return 0;
+    qsort(buf, (size_t)n, sizeof(buf[0]), cmp_u64);
+    return buf[(n - 1) * 99 / 100];
+}
+
+static const char *transport_name(chan_kind_t t) {
+    return t == CHAN_SHM ? "shm" : t == CHAN_TCP ? "tcp" : "pipe";
+}
+
+static const char *bench_dest_name(char *buf, size_t cap) {
+    switch (g_bench_dest) {
+    case DEST_RR:     return "rr";
+    case DEST_RANDOM: return "random";
+    case DEST_FAR:    return "far";
+    default:
+        /* ';' between list entries keeps the CSV column intact */
+        if (dest_name(g_bench_dest, &g_group_in, buf, cap) != buf) return "all";
+        for (char *c = buf; *c; ++c) if (*c == ',') *c = ';';
+        return buf;
+    }
+}
+
+/* One fresh ring per (k, size) pair; one CSV/JSON row per ring */
+static int run_bench(const int *ks, int nk, const int *sizes, int nsizes,
+                     int json, FILE *out) {
+    size_t recs_len = (size_t)g_bench_n * sizeof(bench_rec_t);
+    uint64_t *lat = malloc((size_t)g_bench_n * sizeof(uint64_t));
+    if (!lat) {
+        perror("malloc");
+        return 1;
+    }
+    if (json) fprintf(out, "[\n");
+    else fprintf(out, "transport,mode,topology,k,tokens,slots,size,dest,messages,delivered,setup_us,"
+                      "elapsed_s,msgs_per_s,hop_ns,p50_ns,p99_ns,max_ns,"
+                      "frames_per_read,frames_per_write,blocked_ms,empty_lap_ns,teardown_us,"
+                      "urgent_pct,reserve,p99_urgent_ns,p99_bulk_ns,compress,lz_ratio\n");
+
+    int rows = 0, status = 0;
+    for (int ki = 0; ki < nk && !g_interrupted; ++ki) {
+        for (int si = 0; si < nsizes && !g_interrupted; ++si) {
+            int top = g_bench_dest == DEST_GROUP ? g_group_in.hi[g_group_in.n - 1] : g_bench_dest;
+            if (top >= ks[ki]) {
+                fprintf(stderr, "bench: destination %d is outside k=%d, skipped.\n",
+                        top, ks[ki]);
+                status = 1;
+                continue;
+            }
+            g_bench_recs = mmap(NULL, recs_len + sizeof(bench_io_t), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (g_bench_recs == MAP_FAILED) {
+                perror("mmap");
+                free(lat);
+                return 1;
+            }
+            g_bench_io = (bench_io_t *)(void *)((char *)g_bench_recs + recs_len);
+            g_bench_size = sizes[si];
+            g_bench_sent = 0;
+            /* A ring cut short by Ctrl-C has no row to report */
+            if (run_ring(ks[ki]) != 0 || g_interrupted) {
+                munmap(g_bench_recs, recs_len + sizeof(bench_io_t));
+                g_bench_recs = NULL;
+                g_bench_io = NULL;
+                status = 1;
+                continue;
+            }
+
+            uint64_t p99_urgent = bench_class_p99(lat, PRIO_URGENT);
+            uint64_t p99_bulk = bench_class_p99(lat, PRIO_BULK);
+            int delivered = 0;
+            uint64_t hops = 0, lat_sum = 0;
+            for (int i = 0; i < g_bench_n; ++i) {
+                if (!g_bench_recs[i].hops) continue;
+                lat[delivered++] = g_bench_recs[i].lat_ns;
+                lat_sum += g_bench_recs[i].lat_ns;
+                hops += g_bench_recs[i].hops;
+            }
+            uint64_t rd_calls = atomic_load(&g_bench_io->rd_calls);
+            uint64_t wr_calls = atomic_load(&g_bench_io->wr_calls);
+            double per_read = rd_calls ? (double)atomic_load(&g_bench_io->rd_frames) / (double)rd_calls : 0.0;
+            double per_write = wr_calls ? (double)atomic_load(&g_bench_io->wr_frames) / (double)wr_calls : 0.0;
+            double blocked_ms = (double)atomic_load(&g_bench_io->blocked_ns_max) / 1e6;
+            munmap(g_bench_recs, recs_len + sizeof(bench_io_t));
+            g_bench_recs = NULL;
+            g_bench_io = NULL;
+
+            qsort(lat, (size_t)delivered, sizeof(lat[0]), cmp_u64);
+            double elapsed = (double)(g_run_end_ns - g_run_start_ns) / 1e9;
+            uint64_t p50 = delivered ? lat[(delivered - 1) * 50 / 100] : 0;
+            uint64_t p99 = delivered ? lat[(delivered - 1) * 99 / 100] : 0;
+            uint64_t max = delivered ? lat[delivered - 1] : 0;
+            double hop_ns = hops ? (double)lat_sum / (double)hops : 0.0;
+            double rate = elapsed > 0 ? delivered / elapsed : 0.0;
+            char dbuf[64];
+            const char *dname = bench_dest_name(dbuf, sizeof(dbuf));
+            const char *mode = g_threads ? "thread" : "proc";
+            const char *topo = g_topology == TOPO_BI ? "bi" :
+                               g_topology == TOPO_FINGER ? "finger" : "uni";
+            double setup_us = (double)g_setup_ns / 1e3;
+            double empty_lap = g_empty_laps ? (double)g_empty_ns / g_empty_laps : 0.0;
+            double lz_ratio = g_lz_wire ? (double)g_lz_raw / (double)g_lz_wire : 1.0;
+
+            if (json) {
+                fprintf(out, "%s  {\"transport\": \"%s\", \"mode\": \"%s\", \"topology\": \"%s\", \"k\": %d, \"tokens\": %d, \"slots\": %d, "
+                        "\"size\": %d, \"dest\": \"%s\", \"messages\": %d, \"delivered\": %d, "
+                        "\"setup_us\": %.1f, "
+                        "\"elapsed_s\": %.6f, \"msgs_per_s\": %.1f, \"hop_ns\": %.1f, "
+                        "\"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, "
+                        "\"frames_per_read\": %.2f, \"frames_per_write\": %.2f, \"blocked_ms\": %.3f, "
+                        "\"empty_lap_ns\": %.1f, \"teardown_us\": %.1f, \"urgent_pct\": %d, \"reserve\": %d, "
+                        "\"p99_urgent_ns\": %llu, \"p99_bulk_ns\": %llu, \"compress\": %u, \"lz_ratio\": %.2f}",
+                        rows ? ",\n" : "", transport_name(g_transport), mode, topo, ks[ki], g_tokens,
+                        g_slots, sizes[si], dname, g_bench_n, delivered, setup_us, elapsed, rate, hop_ns,
+                        (unsigned long long)p50, (unsigned long long)p99,
+                        (unsigned long long)max, per_read, per_write, blocked_ms,
+                        empty_lap, (double)g_teardown_ns / 1e3, g_urgent_pct, g_reserve,
+                        (unsigned long long)p99_urgent, (unsigned long long)p99_bulk,
+                        g_lz_min, lz_ratio);
+            } else {
+                fprintf(out, "%s,%s,%s,%d,%d,%d,%d,%s,%d,%d,%.1f,%.6f,%.1f,%.1f,%llu,%llu,%llu,"
+                        "%.2f,%.2f,%.3f,%.1f,%.1f,%d,%d,%llu,%llu,%u,%.2f\n",
+                        transport_name(g_transport), mode, topo, ks[ki], g_tokens, g_slots, sizes[si],
+                        dname, g_bench_n, delivered, setup_us, elapsed, rate, hop_ns,
+                        (unsigned long long)p50, (unsigned long long)p99,
+                        (unsigned long long)max, per_read, per_write, blocked_ms,
+                        empty_lap, (double)g_teardown_ns / 1e3, g_urgent_pct, g_reserve,
+                        (unsigned long long)p99_urgent, (unsigned long long)p99_bulk,
+                        g_lz_min, lz_ratio);
+            }
+            fflush(out);
+            ++rows;
+            if (delivered != g_bench_n) status = 1;
+        }
+    }
+    if (json) fprintf(out, "%s]\n", rows ? "\n" : "");
+    free(lat);
+    return status;
+}
+
+/* --microbench N: time the per-hop primitives on their own, outside any
+ * ring. Every case runs a fixed number of iterations (N, fewer for big
+ * transfers) on fixed inputs; MB_WARMUP repetitions are thrown away, then
+ * MB_REPS are summarised per operation. */
+#define MB_WARMUP 2
+#define MB_REPS   11
+static const int mb_default_sizes[] = {8, 64, 512, 4096, 32768};
+
+/* Move exactly n bytes, sleeping in poll like a node would when the
+ * channel is full (or empty) */
+static int mb_write_full(chan_t *c, const char *buf, size_t n) {
+    while (n) {
+        ssize_t w = chan_send(c, buf, n);
+        if (w > 0) {
+            buf += w;
+            n -= (size_t)w;
+            continue;
+        }
+        if (errno != EAGAIN) return -1;
+        struct pollfd p;
+        chan_poll_tx(c, &p);
+        poll(&p, 1, -1);
+        if (c->kind == CHAN_SHM) efd_drain(p.fd);
+    }
+    return 0;
+}
+
+static int mb_read_full(chan_t *c, char *buf, size_t n) {
+    while (n) {
+        ssize_t r = chan_recv(c, buf, n);
+        if (r > 0) {
+            buf += r;
+            n -= (size_t)r;
+            continue;
+        }
+        if (r == 0 || errno != EAGAIN) return -1;
+        struct pollfd p;
+        chan_poll_rx(c, &p);
+        poll(&p, 1, -1);
+        if (c->kind == CHAN_SHM) efd_drain(p.fd);
+    }
+    return 0;
+}
+
+/* One edge of the given kind; shm edges get their own ring */
+static int mb_edge(edge_t *e, chan_kind_t kind, spsc_ring_t **ring) {
+    *ring = NULL;
+    if (kind == CHAN_SHM) {
+        *ring = aligned_alloc(64, sizeof(spsc_ring_t));
+        if (!*ring) return -1;
+        memset(*ring, 0, sizeof(spsc_ring_t));
+    }
+    chan_kind_t saved = g_transport;
+    g_transport = kind;
+    int rc = edge_open(e, *ring);
+    g_transport = saved;
+    return rc;
+}
+
+static void mb_edge_close(edge_t *e, spsc_ring_t *ring) {
+    chan_close(&e->rd);
+    chan_close(&e->wr);
+    free(ring);
+}
+
+typedef struct mb_case {
+    const char *name;
+    int       (*run)(const struct mb_case *mc, int iters, uint64_t *ns);
+    int         chan;    // runs over a channel of this kind (else framing only)
+    chan_kind_t kind;
+    int         size;    // bytes moved; slots per apple for encode/decode;
+                         // forward: 0 = node_pass_empty only, 1 = a whole hop
+} mb_case_t;
+
+/* Write then read size bytes in one thread: the syscall (or ring copy)
+ * cost without a context switch */
+static int mb_rw(const mb_case_t *mc, int iters, uint64_t *ns) {
+    edge_t e;
+    spsc_ring_t *ring;
+    static char buf[RING_BYTES];
+    if (mb_edge(&e, mc->kind, &ring) < 0) return -1;
+    memset(buf, 'x', (size_t)mc->size);
+    int rc = 0;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iters && rc == 0; ++i) {
+        rc = mb_write_full(&e.wr, buf, (size_t)mc->size) | mb_read_full(&e.rd, buf, (size_t)mc->size);
+    }
+    *ns = now_ns() - t0;
+    mb_edge_close(&e, ring);
+    return rc;
+}
+
+/* A fixed apple: size slots of 64 bytes each, to node 3 */
+static void mb_apple(apple_t *a, int slots) {
+    memset(a, 0, sizeof(*a));
+    a->id = 1;
+    a->used = slots;
+    for (int i = 0; i < slots; ++i) {
+        slot_t *sl = &a->slot[i];
+        sl->dest = 3;
+        sl->seq = (unsigned)i;
+        sl->t_sent = 1;
+        sl->len = sl->total = 64;
+        memset(sl->text, 'a' + i, 64);
+    }
+}
+
+static int mb_encode(const mb_case_t *mc, int iters, uint64_t *ns) {
+    static apple_t a;
+    static char frame[MAX_FRAME];
+    mb_apple(&a, mc->size);
+    size_t sum = 0;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iters; ++i) {
+        a.id = i;   /* keep the compiler from hoisting the encode */
+        sum += apple_encode(&a, frame);
+    }
+    *ns = now_ns() - t0;
+    return sum ? 0 : -1;
+}
+
+static int mb_decode(const mb_case_t *mc, int iters, uint64_t *ns) {
+    static apple_t a, b;
+    static char frame[MAX_FRAME];
+    mb_apple(&a, mc->size);
+    size_t len = apple_encode(&a, frame);
+    int rc = 0;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iters && rc == 0; ++i) {
+        if (apple_decode(frame, len, &b) != (ssize_t)len) rc = -1;
+    }
+    *ns = now_ns() - t0;
+    return rc;
+}
+
+/* Ping-pong an 8-byte frame with a second thread; reports one handoff */
+typedef struct {
+    chan_t *rd, *wr;
+    int     iters;
+} mb_echo_t;
+
+static void *mb_echo(void *arg) {
+    mb_echo_t *m = arg;
+    char b[sizeof(apple_hdr_t)];
+    pin_node(1);
+    for (int i = 0; i < m->iters; ++i) {
+        if (mb_read_full(m->rd, b, sizeof(b)) < 0 || mb_write_full(m->wr, b, sizeof(b)) < 0) break;
+    }
+    return NULL;
+}
+
+static int mb_handoff(const mb_case_t *mc, int iters, uint64_t *ns) {
+    edge_t there, back;
+    spsc_ring_t *r1, *r2 = NULL;
+    if (mb_edge(&there, mc->kind, &r1) < 0) return -1;
+    if (mb_edge(&back, mc->kind, &r2) < 0) {
+        mb_edge_close(&there, r1);
+        return -1;
+    }
+    mb_echo_t m = {.rd = &there.rd, .wr = &back.wr, .iters = iters};
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, mb_echo, &m) ? -1 : 0;
+    char b[sizeof(apple_hdr_t)] = {0};
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iters && rc == 0; ++i) {
+        rc = mb_write_full(&there.wr, b, sizeof(b)) | mb_read_full(&back.rd, b, sizeof(b));
+    }
+    *ns = (now_ns() - t0) / 2;   /* two handoffs per round trip */
+    if (rc == 0) pthread_join(tid, NULL);
+    /* on failure the echo thread is stuck on these channels: leak them */
+    if (rc == 0) {
+        mb_edge_close(&there, r1);
+        mb_edge_close(&back, r2);
+    }
+    return rc;
+}
+
+/* An empty apple through a node: node_pass_empty alone (kind == -1), or
+ * the whole hop, queue + flush + read back, over a channel */
+static int mb_forward(const mb_case_t *mc, int iters, uint64_t *ns) {
+    node_t n;
+    edge_t e;
+    spsc_ring_t *ring = NULL;
+    int hop = mc->size;
+    if (node_init(&n, 0) < 0) return -1;
+    if (hop && mb_edge(&e, mc->kind, &ring) < 0) {
+        node_free(&n);
+        return -1;
+    }
+    chan_t none = {.kind = CHAN_PIPE, .fd = -1, .data_efd = -1, .space_efd = -1};
+    if (node_add_out(&n, hop ? e.wr : none) < 0 || node_add_in(&n, hop ? e.rd : none) < 0) {
+        if (hop) mb_edge_close(&e, ring);
+        node_free(&n);
+        return -1;
+    }
+    n.empty_route = 0;
+    apple_hdr_t hdr = {.id = 1};
+    char frame[sizeof(hdr)];
+    memcpy(frame, &hdr, sizeof(hdr));
+    link_t *out = &n.out[0], *in = &n.in[0];
+    int rc = 0;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iters && rc == 0; ++i) {
+        if (node_pass_empty(&n, frame) != 1) rc = -1;
+        if (!hop) {
+            out->len = 0;
+            continue;
+        }
+        if (link_flush(out) < 0) rc = -1;
+        out->len = out->off = 0;
+        while (rc == 0 && in->len < sizeof(hdr)) {
+            if (link_fill(in) < 0) rc = -1;
+        }
+        in->len = 0;
+    }
+    *ns = now_ns() - t0;
+    node_free(&n);
+    free(ring);
+    return rc;
+}
+
+/* Newton's method; saves linking libm for one standard deviation */
+static double mb_sqrt(double v) {
+    if (v <= 0) return 0;
+    double x = v > 1 ? v : 1;
+    for (int i = 0; i < 64; ++i) x = (x + v / x) / 2;
+    return x;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int run_microbench(int iters, const int *sizes, int nsizes, int json, FILE *out) {
+    mb_case_t cases[4 * MAX_LIST + 16];
+    int nc = 0;
+    static const chan_kind_t kinds[] = {CHAN_PIPE, CHAN_SHM};
+    for (int k = 0; k < 2; ++k) {
+        for (int i = 0; i < nsizes; ++i) {
+            if (sizes[i] < 1 || sizes[i] > RING_BYTES) {
+                if (k == 0)
+                    fprintf(stderr, "Skipping size %d: a one-thread write then read needs "
+                            "1..%d bytes.\n", sizes[i], RING_BYTES);
+                continue;
+            }
+            cases[nc++] = (mb_case_t){"rw", mb_rw, 1, kinds[k], sizes[i]};
+        }
+    }
+    static const int slots[] = {0, 1, 4};
+    for (int i = 0; i < 3; ++i) cases[nc++] = (mb_case_t){"encode", mb_encode, 0, CHAN_PIPE, slots[i]};
+    for (int i = 0; i < 3; ++i) cases[nc++] = (mb_case_t){"decode", mb_decode, 0, CHAN_PIPE, slots[i]};
+    for (int k = 0; k < 2; ++k) cases[nc++] = (mb_case_t){"handoff", mb_handoff, 1, kinds[k], 8};
+    cases[nc++] = (mb_case_t){"forward", mb_forward, 0, CHAN_PIPE, 0};
+    for (int k = 0; k < 2; ++k) cases[nc++] = (mb_case_t){"forward", mb_forward, 1, kinds[k], 1};
+
+    /* node_init needs a stats block to count into */
+    g_k = 1;
+    g_stats = calloc(1, sizeof(*g_stats));
+    if (!g_stats) {
+        perror("calloc");
+        return 1;
+    }
+    pin_node(0);
+    signal(SIGPIPE, SIG_IGN);
+    if (json) fprintf(out, "[\n");
+    else fprintf(out, "case,transport,size,iters,reps,min_ns,median_ns,mean_ns,stddev_ns,max_ns\n");
+    int status = 0, rows = 0;
+    for (int c = 0; c < nc && !g_interrupted; ++c) {
+        const mb_case_t *mc = &cases[c];
+        /* Same work per repetition for every size: big transfers run fewer times */
+        int n = mc->run == mb_rw ? iters / (1 + mc->size / 4096) : iters;
+        if (n < 1) n = 1;
+        double per_op[MB_REPS];
+        int failed = 0;
+        for (int r = 0; r < MB_WARMUP + MB_REPS && !failed; ++r) {
+            uint64_t ns = 0;
+            failed = mc->run(mc, n, &ns) < 0;
+            if (r >= MB_WARMUP) per_op[r - MB_WARMUP] = (double)ns / n;
+        }
+        const char *via = mc->chan ? transport_name(mc->kind) : "-";
+        if (failed) {
+            fprintf(stderr, "microbench %s/%s/%d failed: %s\n", mc->name, via, mc->size,
+                    strerror(errno));
+            status = 1;
+            continue;
+        }
+        qsort(per_op, MB_REPS, sizeof(per_op[0]), cmp_double);
+        double mean = 0, var = 0;
+        for (int r = 0; r < MB_REPS; ++r) mean += per_op[r] / MB_REPS;
+        for (int r = 0; r < MB_REPS; ++r) var += (per_op[r] - mean) * (per_op[r] - mean) / (MB_REPS - 1);
+        double median = per_op[MB_REPS / 2], sd = mb_sqrt(var);
+        if (json) {
+            fprintf(out, "%s  {\"case\": \"%s\", \"transport\": \"%s\", \"size\": %d, \"iters\": %d, "
+                    "\"reps\": %d, \"min_ns\": %.1f, \"median_ns\": %.1f, \"mean_ns\": %.1f, "
+                    "\"stddev_ns\": %.1f, \"max_ns\": %.1f}", rows ? ",\n" : "", mc->name, via,
+                    mc->size, n, MB_REPS, per_op[0], median, mean, sd, per_op[MB_REPS - 1]);
+        } else {
+            fprintf(out, "%s,%s,%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n", mc->name, via, mc->size, n,
+                    MB_REPS, per_op[0], median, mean, sd, per_op[MB_REPS - 1]);
+        }
+        fflush(out);
+        ++rows;
+    }
+    if (json) fprintf(out, "%s]\n", rows ? "\n" : "");
+    free(g_stats);
+    g_stats = NULL;
+    return status;
+}
+
+typedef struct {
+    uint64_t ts_ns;
+    char     line[160];
+} merged_ev_t;
+
+static int cmp_merged(const void *a, const void *b) {
+    const merged_ev_t *x = a, *y = b;
+    return (x->ts_ns > y->ts_ns) - (x->ts_ns < y->ts_ns);
+}
+
+static int merge_traces(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return 1;
+    }
+    merged_ev_t *evs = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        int id;
+        char tail;
+        if (sscanf(de->d_name, "node-%d.trac%c", &id, &tail) != 2 || tail != 'e') continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            perror(path);
+            continue;
+        }
+        char buf[256];
+        while (fgets(buf, sizeof(buf), f)) {
+            if (buf[0] == '#') {
+                fprintf(stderr, "%s: %s", de->d_name, buf);
+                continue;
+            }
+            if (n == cap) {
+                cap = cap ? cap * 2 : 4096;
+                merged_ev_t *grown = realloc(evs, cap * sizeof(*evs));
+                if (!grown) {
+                    perror("realloc");
+                    free(evs);
+                    fclose(f);
+                    closedir(d);
+                    return 1;
+                }
+                evs = grown;
+            }
+            unsigned long long ts;
+            int off = 0;
+            if (sscanf(buf, "%llu %n", &ts, &off) != 1) continue;
+            chomp(buf);
+            evs[n].ts_ns = ts;
+            snprintf(evs[n].line, sizeof(evs[n].line), "%s", buf + off);
+            ++n;
+        }
+        fclose(f);
+    }
+    closedir(d);
+
+    /* qsort isn't stable, but per-node events already carry distinct stamps */
+    qsort(evs, n, sizeof(*evs), cmp_merged);
+    printf("# t_us node event apple dest origin seq used\n");
+    for (size_t i = 0; i < n; ++i) {
+        printf("%.3f %s\n", (double)(evs[i].ts_ns - evs[0].ts_ns) / 1e3, evs[i].line);
+    }
+    free(evs);
     return 0;
 }
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-k nodes] [-b file|-] [-t tokens] [-s slots] [-T transport] [-l level]\n"
+            "       %s -T tcp --hosts FILE [--node-id I] [options]\n"
+            "       %s --bench N [-k list] [--size list] [--dest rr|random|far|ID]\n"
+            "            [--format csv|json] [-o file] [-t tokens] [-s slots] [-T transport]\n"
+            "       %s --listen PATH -k nodes [options]\n"
+            "       %s --submit PATH [-b file|-]\n"
+            "       %s --microbench N [--size list] [--format csv|json] [-o file] [--cpus L]\n"
+            "       %s --merge-traces DIR\n"
+            "  -k, --nodes N    ring size (2..%d); prompted for if omitted\n"
+            "  -b, --batch F    read \"dest<TAB>text\" records from F ('-' = stdin)\n"
+            "                   and inject them as fast as the apple returns; dest is\n"
+            "                   a node id, '*' for every node, a list like 1,3,5-9\n"
+            "                   or a bitmask like 0x2a; '!' in front (e.g. !3) makes\n"
+            "                   the record urgent, sent ahead of the bulk ones queued\n"
+            "  -t, --tokens N   apples circulating concurrently (1..%d, default 1)\n"
+            "  -s, --slots N    messages node 0 may load onto one apple (1..%d, default 1)\n"
+            "      --compress N pack messages of N bytes or more at node 0 and unpack\n"
+            "                   them only at the destination (0 = off, the default)\n"
+            "      --reserve N  slots per apple that only urgent messages may use\n"
+            "                   (less than -s; default 0)\n"
+            "      --inflight B payload bytes node 0 may have out in the ring at once;\n"
+            "                   apples hand theirs back as they return (0 = no limit)\n"
+            "  -T, --transport pipe|shm|tcp\n"
+            "                   neighbor edges: pipes (default), shared-memory rings,\n"
+            "                   or TCP connections between separately started nodes\n"
+            "      --hosts F    -T tcp: \"id host:port\" for every node (sets -k)\n"
+            "      --node-id I  -T tcp: run node I of --hosts here (default 0, the\n"
+            "                   one that takes input); start one per node, any order\n"
+            "      --threads    run nodes as threads of one process (default -T shm)\n"
+            "      --spin N     check idle shm rings N times before sleeping (needs\n"
+            "                   a core per node; 0 = always sleep, the default)\n"
+            "      --splice     transit nodes splice() payloads pipe to pipe instead\n"
+            "                   of copying them through user space\n"
+            "      --topology T uni (default: i -> i+1 only), bi (edges both ways;\n"
+            "                   each apple goes the shorter way round) or finger\n"
+            "                   (extra i -> i+2^j skip links, O(log k) hops)\n"
+            "      --cpus L     pin node i to the i-th CPU of L (e.g. 0-3,8-11; wraps),\n"
+            "                   and keep each shm ring on its reader's NUMA node\n"
+            "      --worker     run each node's message handler on its own thread so\n"
+            "                   delivery never holds up forwarding\n"
+            "      --handler-us N\n"
+            "                   make the handler take N us per message (default 0)\n"
+            "      --bench N    inject N generated messages per ring and report\n"
+            "                   throughput and delivery latency, after timing a run of\n"
+            "                   empty laps; -k and --size take comma-separated lists\n"
+            "                   and every pair gets a fresh ring\n"
+            "      --size L     payload bytes per bench message (default 64)\n"
+            "      --urgent P   send P%% of bench messages urgent and report p99 per class\n"
+            "      --dest P     bench destinations: rr (default), random, far, or any\n"
+            "                   destination -b takes ('*' and lists fan out)\n"
+            "      --format F   bench output: csv (default) or json\n"
+            "  -o, --output F   write bench results to F instead of stdout\n"
+            "  -l, --log L      silent, deliver (deliveries and lifecycle) or trace\n"
+            "                   (every hop; default except under --bench)\n"
+            "  -q, --quiet      same as --log silent\n"
+            "      --stats      print per-node counters and a latency histogram summary\n"
+            "                   when the ring stops (SIGUSR2 to node 0 prints one live)\n"
+            "      --watchdog MS\n"
+            "                   reissue any apple not back at node 0 within MS ms and\n"
+            "                   respawn nodes that die (forked -T pipe rings only)\n"
+            "      --listen P   keep the ring up and take -b style records from any\n"
+            "                   number of clients on Unix socket P until Ctrl-C or SIGTERM\n"
+            "      --submit P   send -b style records (-b F, default stdin) to the ring\n"
+            "                   listening on P, then exit\n"
+            "      --trace-buf N\n"
+            "                   keep the last N hop events per node in memory; written to\n"
+            "                   <trace-dir>/node-<id>.trace on exit or on SIGUSR2 to node 0\n"
+            "      --trace-dir D  where trace files go (default .)\n"
+            "      --microbench N\n"
+            "                   time the per-hop primitives alone (channel write+read\n"
+            "                   per --size, framing, thread handoff, empty forwarding),\n"
+            "                   N iterations x %d repetitions after %d warm-ups, and exit\n"
+            "      --merge-traces D\n"
+            "                   print all node traces in D merged by timestamp and exit\n",
+            prog, prog, prog, prog, prog, prog, prog, MAX_K, MAX_TOKENS, MAX_SLOTS, MB_REPS, MB_WARMUP);
+}
+
+int main(int argc, char **argv) {
+    enum { OPT_BENCH = 256, OPT_SIZE, OPT_DEST, OPT_FORMAT, OPT_TRACE_BUF, OPT_TRACE_DIR,
+           OPT_MERGE, OPT_THREADS, OPT_SPIN, OPT_SPLICE, OPT_TOPOLOGY, OPT_WORKER,
+           OPT_HANDLER_US, OPT_INFLIGHT, OPT_CPUS, OPT_STATS, OPT_WATCHDOG,
+           OPT_LISTEN, OPT_SUBMIT, OPT_URGENT, OPT_RESERVE,
+           OPT_COMPRESS, OPT_HOSTS, OPT_NODE_ID, OPT_MICROBENCH };
+    static const struct option long_opts[] = {
+        {"nodes", required_argument, NULL, 'k'},
+        {"batch", required_argument, NULL, 'b'},
+        {"tokens", required_argument, NULL, 't'},
+        {"slots", required_argument, NULL, 's'},
+        {"transport", required_argument, NULL, 'T'},
+        {"threads", no_argument, NULL, OPT_THREADS},
+        {"spin", required_argument, NULL, OPT_SPIN},
+        {"splice", no_argument, NULL, OPT_SPLICE},
+        {"topology", required_argument, NULL, OPT_TOPOLOGY},
+        {"worker", no_argument, NULL, OPT_WORKER},
+        {"handler-us", required_argument, NULL, OPT_HANDLER_US},
+        {"inflight", required_argument, NULL, OPT_INFLIGHT},
+        {"cpus", required_argument, NULL, OPT_CPUS},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"watchdog", required_argument, NULL, OPT_WATCHDOG},
+        {"listen", required_argument, NULL, OPT_LISTEN},
+        {"submit", required_argument, NULL, OPT_SUBMIT},
+        {"urgent", required_argument, NULL, OPT_URGENT},
+        {"reserve", required_argument, NULL, OPT_RESERVE},
+        {"compress", required_argument, NULL, OPT_COMPRESS},
+        {"hosts", required_argument, NULL, OPT_HOSTS},
+        {"node-id", required_argument, NULL, OPT_NODE_ID},
+        {"microbench", required_argument, NULL, OPT_MICROBENCH},
+        {"bench", required_argument, NULL, OPT_BENCH},
+        {"size", required_argument, NULL, OPT_SIZE},
+        {"dest", required_argument, NULL, OPT_DEST},
+        {"format", required_argument, NULL, OPT_FORMAT},
+        {"output", required_argument, NULL, 'o'},
+        {"log", required_argument, NULL, 'l'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"trace-buf", required_argument, NULL, OPT_TRACE_BUF},
+        {"trace-dir", required_argument, NULL, OPT_TRACE_DIR},
+        {"merge-traces", required_argument, NULL, OPT_MERGE},
+        {"help",  no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int ks[MAX_LIST], nk = 0;
+    int sizes[MAX_LIST] = {64}, nsizes = 1;
+    int json = 0;
+    int transport_set = 0;
+    const char *batch_path = NULL;
+    const char *listen_path = NULL, *submit_path = NULL, *hosts_path = NULL;
+    int micro_n = 0, sizes_set = 0;
+    const char *out_path = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "k:b:t:s:T:o:l:qh", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'k':
+            nk = parse_list(optarg, 2, MAX_K, ks, MAX_LIST);
+            if (nk < 1) {
+                fprintf(stderr, "Invalid k '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            batch_path = optarg;
+            break;
+        case 't':
+            if (parse_destination(optarg, MAX_TOKENS + 1, &g_tokens) != 0 || g_tokens < 1) {
+                fprintf(stderr, "Invalid token count '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            if (parse_destination(optarg, MAX_SLOTS + 1, &g_slots) != 0 || g_slots < 1) {
+                fprintf(stderr, "Invalid slot count '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T':
+            transport_set = 1;
+            if (strcmp(optarg, "pipe") == 0) {
+                g_transport = CHAN_PIPE;
+            } else if (strcmp(optarg, "shm") == 0) {
+                g_transport = CHAN_SHM;
+            } else if (strcmp(optarg, "tcp") == 0) {
+                g_transport = CHAN_TCP;
+            } else {
+                fprintf(stderr, "Unknown transport '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_THREADS:
+            g_threads = 1;
+            break;
+        case OPT_SPLICE:
+            g_splice = 1;
+            break;
+        case OPT_INFLIGHT: {
+            int n;
+            if (parse_destination(optarg, INT32_MAX, &n) != 0) {
+                fprintf(stderr, "Invalid in-flight byte budget '%s'.\n", optarg);
+                return 1;
+            }
+            g_inflight_max = (uint64_t)n;
+            break;
+        }
+        case OPT_CPUS:
+            free(g_cpus);
+            g_cpus = NULL;
+            g_ncpus = parse_cpus(optarg, &g_cpus);
+            if (g_ncpus < 0) {
+                fprintf(stderr, "Invalid CPU list '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_STATS:
+            g_stats_at_exit = 1;
+            break;
+        case OPT_WATCHDOG: {
+            int n;
+            if (parse_destination(optarg, INT32_MAX, &n) != 0 || n < 1) {
+                fprintf(stderr, "Invalid watchdog timeout '%s' (milliseconds, at least 1).\n", optarg);
+                return 1;
+            }
+            g_watchdog_ns = (uint64_t)n * 1000000u;
+            break;
+        }
+        case OPT_LISTEN:
+            listen_path = optarg;
+            break;
+        case OPT_URGENT:
+            if (parse_destination(optarg, 101, &g_urgent_pct) != 0) {
+                fprintf(stderr, "Invalid urgent share '%s' (percent, 0..100).\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_HOSTS:
+            hosts_path = optarg;
+            break;
+        case OPT_MICROBENCH:
+            if (parse_destination(optarg, INT32_MAX, &micro_n) != 0 || micro_n < 1) {
+                fprintf(stderr, "Invalid microbench iteration count '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_NODE_ID:
+            if (parse_destination(optarg, MAX_K, &g_node_id) != 0) {
+                fprintf(stderr, "Invalid node id '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_COMPRESS: {
+            int n;
+            if (parse_destination(optarg, INT32_MAX, &n) != 0) {
+                fprintf(stderr, "Invalid compression threshold '%s' (bytes, 0 = off).\n", optarg);
+                return 1;
+            }
+            g_lz_min = (uint32_t)n;
+            break;
+        }
+        case OPT_RESERVE:
+            if (parse_destination(optarg, MAX_SLOTS, &g_reserve) != 0) {
+                fprintf(stderr, "Invalid reserved slot count '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_SUBMIT:
+            submit_path = optarg;
+            break;
+        case OPT_WORKER:
+            g_worker = 1;
+            break;
+        case OPT_HANDLER_US: {
+            int n;
+            if (parse_destination(optarg, INT32_MAX, &n) != 0) {
+                fprintf(stderr, "Invalid handler time '%s'.\n", optarg);
+                return 1;
+            }
+            g_handler_ns = (uint64_t)n * 1000;
+            break;
+        }
+        case OPT_TOPOLOGY:
+            if (strcmp(optarg, "uni") == 0) g_topology = TOPO_UNI;
+            else if (strcmp(optarg, "bi") == 0) g_topology = TOPO_BI;
+            else if (strcmp(optarg, "finger") == 0) g_topology = TOPO_FINGER;
+            else {
+                fprintf(stderr, "Unknown topology '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_SPIN: {
+            int n;
+            if (parse_destination(optarg, INT32_MAX, &n) != 0) {
+                fprintf(stderr, "Invalid spin count '%s'.\n", optarg);
+                return 1;
+            }
+            g_spin = (unsigned)n;
+            break;
+        }
+        case OPT_BENCH:
+            if (parse_destination(optarg, INT32_MAX, &g_bench_n) != 0 || g_bench_n < 1) {
+                fprintf(stderr, "Invalid bench message count '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_SIZE:
+            nsizes = parse_list(optarg, 0, BENCH_SIZE_MAX, sizes, MAX_LIST);
+            if (nsizes < 1) {
+                fprintf(stderr, "Invalid size list '%s' (0..%d).\n", optarg, BENCH_SIZE_MAX);
+                return 1;
+            }
+            sizes_set = 1;
+            break;
+        case OPT_DEST:
+            if (strcmp(optarg, "rr") == 0) g_bench_dest = DEST_RR;
+            else if (strcmp(optarg, "random") == 0) g_bench_dest = DEST_RANDOM;
+            else if (strcmp(optarg, "far") == 0) g_bench_dest = DEST_FAR;
+            else if (parse_target(optarg, MAX_K, &g_bench_dest, &g_group_in) != 0) {
+                fprintf(stderr, "Invalid bench destination '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_FORMAT:
+            if (strcmp(optarg, "csv") == 0) json = 0;
+            else if (strcmp(optarg, "json") == 0) json = 1;
+            else {
+                fprintf(stderr, "Unknown format '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'l':
+            if (strcmp(optarg, "silent") == 0) g_log = LOG_SILENT;
+            else if (strcmp(optarg, "deliver") == 0) g_log = LOG_DELIVER;
+            else if (strcmp(optarg, "trace") == 0) g_log = LOG_TRACE;
+            else {
+                fprintf(stderr, "Unknown log level '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'q':
+            g_log = LOG_SILENT;
+            break;
+        case OPT_TRACE_BUF: {
+            int n;
+            if (parse_destination(optarg, (1 << 24) + 1, &n) != 0 || n < 1) {
+                fprintf(stderr, "Invalid trace buffer size '%s'.\n", optarg);
+                return 1;
+            }
+            g_trace_cap = 1;
+            while (g_trace_cap < (unsigned)n) g_trace_cap <<= 1;
+            break;
+        }
+        case OPT_TRACE_DIR:
+            g_trace_dir = optarg;
+            break;
+        case OPT_MERGE:
+            return merge_traces(optarg);
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (submit_path) {
+        FILE *f = !batch_path || strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+        if (!f) {
+            perror(batch_path);
+            return 1;
+        }
+        return submit_records(submit_path, f);
+    }
+    if (listen_path && (batch_path || g_bench_n)) {
+        fprintf(stderr, "--listen takes its records from clients; drop -b and --bench.\n");
+        return 1;
+    }
+
+    /* Threads share an address space, so in-memory rings are the natural edge */
+    if (g_threads && !transport_set && !g_splice) g_transport = CHAN_SHM;
+    if ((g_transport == CHAN_TCP) != (hosts_path != NULL)) {
+        fprintf(stderr, "-T tcp and --hosts go together: the file says where every node is.\n");
+        return 1;
+    }
+    if (hosts_path) {
+        /* One process per node; node 0's is the only one that injects */
+        if (g_threads || g_splice || g_watchdog_ns || g_bench_n) {
+            fprintf(stderr, "-T tcp runs one process per node: --threads, --splice, --watchdog "
+                    "and --bench need the whole ring on one host.\n");
+            return 1;
+        }
+        int hk = hosts_load(hosts_path);
+        if (hk < 0) return 1;
+        if ((nk && ks[0] != hk) || nk > 1) {
+            fprintf(stderr, "-k %d doesn't match the %d nodes in %s.\n", ks[0], hk, hosts_path);
+            return 1;
+        }
+        if (g_node_id >= hk) {
+            fprintf(stderr, "Node id %d isn't in %s (0..%d).\n", g_node_id, hosts_path, hk - 1);
+            return 1;
+        }
+        if (g_node_id != 0 && (batch_path || listen_path)) {
+            fprintf(stderr, "Only node 0 takes input; drop -b and --listen here.\n");
+            return 1;
+        }
+        ks[0] = hk;
+        nk = 1;
+    } else if (g_node_id != 0) {
+        fprintf(stderr, "--node-id needs -T tcp --hosts.\n");
+        return 1;
+    }
+    if (g_reserve >= g_slots) {
+        /* bulk messages need at least one slot of their own */
+        fprintf(stderr, "--reserve must leave bulk messages a slot: use fewer than -s (%d).\n",
+                g_slots);
+        return 1;
+    }
+    if (g_splice && g_transport != CHAN_PIPE) {
+        fprintf(stderr, "--splice moves bytes between pipes; it needs -T pipe.\n");
+        return 1;
+    }
+    if (g_watchdog_ns && (g_threads || g_transport != CHAN_PIPE || g_splice)) {
+        /* respawning means forking a node onto fresh pipes mid-run */
+        fprintf(stderr, "--watchdog respawns child processes on new pipes; it needs a forked "
+                "-T pipe ring without --splice.\n");
+        return 1;
+    }
+
+    /* Benchmarks measure the ring, not the terminal */
+    if (g_log < 0) g_log = g_bench_n || micro_n ? LOG_SILENT : LOG_TRACE;
+    /* Make stdout line-buffered for all processes so logs appear quickly */
+    if (g_log > LOG_SILENT) setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (micro_n) {
+        FILE *out = out_path ? fopen(out_path, "w") : stdout;
+        if (!out) {
+            perror(out_path);
+            return 1;
+        }
+        int n = sizeof(mb_default_sizes) / sizeof(mb_default_sizes[0]);
+        int status = sizes_set ? run_microbench(micro_n, sizes, nsizes, json, out)
+                               : run_microbench(micro_n, mb_default_sizes, n, json, out);
+        if (out != stdout) fclose(out);
+        return status;
+    }
+    if (g_bench_n) {
+        if (nk == 0) ks[nk++] = 8;
+        FILE *out = out_path ? fopen(out_path, "w") : stdout;
+        if (!out) {
+            perror(out_path);
+            return 1;
+        }
+        int status = run_bench(ks, nk, sizes, nsizes, json, out);
+        if (out != stdout) fclose(out);
+        return status;
+    }
+    if (nk > 1) {
+        fprintf(stderr, "A list of k values is only meaningful with --bench.\n");
+        return 1;
+    }
+    int k = nk ? ks[0] : 0;
+
+    printf("=== One Bad Apple (CIS 452) ===\n");
+    if (batch_path) {
+        if (k == 0) {
+            fprintf(stderr, "Batch mode needs -k (stdin may be carrying the records).\n");
+            return 1;
+        }
+        g_batch = strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+        if (!g_batch) {
+            perror(batch_path);
+            return 1;
+        }
+    }
+    if (listen_path) {
+        if (k == 0) {
+            fprintf(stderr, "--listen needs -k (the ring runs unattended).\n");
+            return 1;
+        }
+        if (daemon_open(listen_path) != 0) return 1;
+        int status = run_ring(k);
+        daemon_close();
+        return status;
+    }
+    if (k == 0) {
+        printf("Enter number of nodes k (2..%d): ", MAX_K);
+        fflush(stdout);
+        if (scanf("%d", &k) != 1 || k < 2 || k > MAX_K) {
+            fprintf(stderr, "Invalid k.\n");
+            return 1;
+        }
+        /* Consume the newline left by scanf so that fgets works later */
+        int c;
+        while ((c = getchar()) != '\n' && c != EOF) {}
+    }
+
+    return run_ring(k);
+}